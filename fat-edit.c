@@ -5,1881 +5,5746 @@
  * File: fat-edit.c
  ***/
 
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <string.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <sys/uio.h>
+#include "libfatedit.h"
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#ifdef __SSE2__
+#include <immintrin.h>
+#define HAVE_SSE2 1
+#endif
 
 #define BUFFER_SIZE 128
+#define MAX_ARGS (BUFFER_SIZE/2)
+#define ARENA_BYTES 4096
+#define READ_BUFFER 4096
 #define LCD_SSIZE 512
+#define MAX_SSIZE 4096
 #define READ_ONLY 0x01
+#define VOLUME_ID 0x08
+#define HIDDEN 0x02
+#define SYSTEM 0x04
+#define ARCHIVE 0x20
+
+// syncVolume durability
+#define SYNC_FSYNC 1
+#define SYNC_FDATASYNC 2
+
+// stampEntry fields
+#define STAMP_CREATED 0x01
+#define STAMP_MODIFIED 0x02
+#define STAMP_ACCESSED 0x04
+
+// fat_ls output formats
+#define LS_NAMES 0
+#define LS_LONG 1
+#define LS_JSON 2
 #define LONG_DIRECTORY 0x0F
 #define SUB_DIRECTORY 0x10
 #define EoC 0x0FFFFFF8
 #define EMPTY 0x00000000
 #define FREE 0xFFFFFFE5
+#define READ_AHEAD_CLUSTERS 16
+#define IO_QUEUE_DEPTH 64
+#define FAT_SCAN_BYTES (1024*1024)
+#define DIR_SCAN_BYTES 4096
+#define WALK_THREADS 4
+#define FLUSH_IOV 1024
+#define COPY_BUFFER (1024*1024)
+#define CACHE_BLOCKS 4096
+#define OVERLAY_MAGIC "FATEDITD"
+#define OVERLAY_HEADER 16
+#define OVERLAY_BUCKETS 65536
+#define DAEMON_BACKLOG 64
+#define DAEMON_MAX_REQUEST 65536
+#define MAX_PARTITIONS 128
+#define GPT_SIGNATURE "EFI PART"
+#define MBR_PROTECTIVE 0xEE
+
+/*** MKFS DEFAULTS ***/
+#define MKFS_SIZE_MB 64
+#define MKFS_RESERVED_SECTORS 32
+#define MKFS_BACKUP_BOOT 6
+#define MKFS_MIN_CLUSTERS 65525
+#define MKFS_MAX_FILE_CLUSTERS 4
+#define FSINFO_LEAD_SIG 0x41615252
+#define FSINFO_STRUC_SIG 0x61417272
+#define FSINFO_TRAIL_SIG 0xAA550000
 
 
 /*** PROTOTYPES ***/
 void init_env(char* file);
 void prompt();
 void read_input();
+void parse_input();
 void clear_buffer();
+void *arenaAlloc(unsigned int len);
 void execute();
+int commandOrder(const void *a, const void *b);
 void usage_error(char *cmd);
+void usage();
+void run_exit();
+void run_fsinfo();
+void run_open();
+void run_close();
+void run_create();
+void run_read();
+void run_write();
+void run_rm();
+void run_srm();
+void run_cd();
+void run_ls();
+void run_mkdir();
+void run_mv();
+void run_cp();
+void run_compact();
+void run_truncate();
+void run_rmdir();
+void run_find();
+void run_size();
+void run_sync();
+void run_recount();
+void run_commit();
+void run_discard();
 
 void fat_info();
 int fat_open(char *file_name, char *mode);
 int fat_close(char *file_name);
 int fat_create(char *file_name);
 int fat_read(char *file_name, unsigned int start_pos, unsigned int num_bytes);
-int fat_write(char *file_name, unsigned int start_pos, char *quoted_data);
+int fat_write(char *file_name, unsigned int *start_pos, char *quoted_data);
 int fat_rm(char *file_name, int clear);
 int fat_cd(char *dir_name);
-int fat_ls(char *dir_name);
+int fat_ls(char *dir_name, int format);
 int fat_mkdir(char *dir_name);
 int fat_rmdir(char *dir_name);
+int fat_mv(char *from, char *to);
+int fat_cp(char *from, char *to);
+int fat_resize(char *file_name, char *size, int shrink);
+int fat_compact(char *dir_name);
 int fat_size(char *file_name);
+int fat_find(char **args, int num_args, int du);
+int fat_mkfs(char *file);
 
-int seekTo(int location);
-unsigned int firstSectorOfCluster(int n);
-unsigned int getNextCluster(int entryIndex);
+unsigned int firstSectorOfCluster(unsigned int n);
+unsigned int getNextCluster(unsigned int entryIndex);
 unsigned int combineShorts(unsigned short high, unsigned short low);
-unsigned int newCluster(unsigned int linkedCluster);
+void setFATEntry(unsigned int cluster, unsigned int value);
+unsigned int findFreeCluster();
+unsigned int findFreeRun(unsigned int count);
+unsigned int newCluster(unsigned int linkedCluster, unsigned int keep);
 unsigned int newDirectoryCluster();
+int readAhead(unsigned int cluster, int count, unsigned int *last);
+void eraseClusterChain(unsigned int startCluster);
 void clearClusterChain(unsigned int startCluster);
 void convertFilename(char *filename);
 void removeTailWhitespace(char *filename);
+void makeDirEntry(char *entry, char *shortname, char attr,
+                  unsigned int cluster, unsigned int size);
+void formatFilename(char *shortname, char *name);
+void formatAttributes(unsigned char attr, char *attrs);
+void formatTimestamp(long long seconds, char *text);
+unsigned int mkfsAllocCluster(unsigned int linkedCluster);
+int mkfsPopulate(unsigned int dirCluster, unsigned int parentCluster, int level);
+unsigned int mkfsRandom();
+
+/*** BLOCK CACHE ***/
+// one cached sector, linked into a hash bucket and the LRU list
+typedef struct cache_block {
+  unsigned int sector;
+  int dirty;
+  struct cache_block *hashNext;
+  struct cache_block *prev, *next;
+  char data[];
+} cache_block;
+
+void cacheInit(int blocks);
+char *cacheGet(unsigned int sector, int load);
+char *cacheLookup(unsigned int sector);
+char *cacheInsert(unsigned int sector, char *contents);
+void cacheRelease(off_t offset, unsigned int len);
+int cacheFlush();
+int blockOrder(const void *a, const void *b);
+void cacheInvalidate();
+int readImage(off_t offset, void *buf, unsigned int len);
+int writeImage(off_t offset, void *buf, unsigned int len);
+int zeroImage(off_t offset, unsigned int len);
+
+/*** I/O ENGINE ***/
+// positioned read or write of one buffer, submitted in batches
+typedef struct {
+  int write;
+  char *buf;
+  unsigned int len;
+  off_t offset;
+} io_request;
+
+int ioInit();
+int ioBatch(io_request *reqs, int count);
+int ioSubmitUring(io_request *reqs, int count);
+int ioSubmitPositioned(io_request *reqs, int count);
+int ioCopy(off_t from, off_t to, off_t len);
+int ioZero(off_t to, off_t len);
+
+/*** OVERLAY ***/
+// location of a sector's latest copy in the delta file
+typedef struct overlay_entry {
+  unsigned int sector;
+  off_t offset;
+  struct overlay_entry *next;
+} overlay_entry;
+
+int overlayOpen(char *file);
+overlay_entry *overlayLookup(unsigned int sector);
+int overlayCommit();
+int overlayDiscard();
+int overlayClose();
+int overlayTransfer(io_request *req);
+int readSector(unsigned int sector, char *buf);
+int sectorLocation(unsigned int sector, off_t *offset);
+int writeSector(unsigned int sector, char *buf);
+
+/*** COMMANDS ***/
+// a REPL command, run with between minArgs and maxArgs arguments, the table
+// is sorted by name
+typedef struct {
+  const char *name;
+  int minArgs, maxArgs;
+  void (*run)();
+} command_entry;
+
+static const command_entry commands[] = {
+  {"cd", 1, 1, run_cd},
+  {"close", 1, 1, run_close},
+  {"commit", 0, 0, run_commit},
+  {"compact", 1, 1, run_compact},
+  {"cp", 2, 2, run_cp},
+  {"create", 1, 1, run_create},
+  {"discard", 0, 0, run_discard},
+  {"du", 1, MAX_ARGS, run_find},
+  {"exit", 0, 0, run_exit},
+  {"fallocate", 2, 2, run_truncate},
+  {"find", 1, MAX_ARGS, run_find},
+  {"fsinfo", 0, 0, run_fsinfo},
+  {"ls", 1, 2, run_ls},
+  {"mkdir", 1, 1, run_mkdir},
+  {"mv", 2, 2, run_mv},
+  {"open", 2, 2, run_open},
+  {"read", 3, 3, run_read},
+  {"recount", 0, 0, run_recount},
+  {"rm", 1, 1, run_rm},
+  {"rmdir", 1, 1, run_rmdir},
+  {"size", 1, 1, run_size},
+  {"srm", 1, 1, run_srm},
+  {"sync", 0, 0, run_sync},
+  {"truncate", 2, 2, run_truncate},
+  {"write", 3, 3, run_write}
+};
 
 /*** GLOBALS ***/
-int imageid;
-int sizeFAT, rootLoc, rootCluster, firstDataSector, numTotalSectors,
-    currentCluster, bytesPerCluster, nextFreeLocation, numFreeSectors;
-unsigned short bytesPerSector, reservedSectorCount, fsinfo;
-char sectorsPerCluster, numFATs;
-char psector[LCD_SSIZE];
-char name[8];
-
-int stay_alive;
-char *username;
-char *imagename;
-char *buffer;
-char *command;
-char **command_args;
-int num_command_args;
-
-// open file table
+static int readAheadClusters = READ_AHEAD_CLUSTERS;
+
+// input state of the thread running commands, the line and its tokens
+// live in the thread's arena, which is emptied at once before every
+// command instead of freeing them piece by piece
+static __thread int stay_alive;
+static char *username;
+static __thread char arena[ARENA_BYTES] __attribute__((aligned(16)));
+static __thread unsigned int arenaUsed;
+static __thread char *buffer;
+static __thread char *command;
+static __thread char **command_args;
+static __thread int num_command_args;
+
+// where command output goes, stdout or a daemon client's capture buffer
+static __thread FILE *out;
+
+// directory entry of an open file shared by every handle on it, size and
+// timestamp changes collect here until the file is closed or synced; tail
+// is the furthest cluster of the chain a write has reached and tailIndex
+// its place in the chain, writes past it start there instead of walking
+// the chain from the front; cuts counts the times the chain was cut short
+// so handles know the clusters they remember may be gone
+typedef struct open_entry {
+  off_t offset;
+  char entry[32];
+  int dirty, deleted, refs;
+  unsigned int tail, tailIndex, cuts;
+  time_t stamped;
+  struct open_entry *next;
+} open_entry;
+
+// an open FAT32 image with its geometry and caches
+typedef struct {
+  char *imagename;
+  int imageid;
+  // partition the volume lives in and its byte offset in the image, every
+  // transfer on imageid adds base to a volume relative offset
+  int partition;
+  off_t base;
+  unsigned int sizeFAT, rootLoc, rootCluster, firstDataSector, numTotalSectors,
+               bytesPerCluster;
+  unsigned int numClusters;
+  // FSInfo free cluster count and allocation hint, kept current by
+  // setFATEntry and newCluster and written back on sync
+  unsigned int freeClusters, nextFreeLocation;
+  int fsInfoDirty;
+
+  // entries of the files open in any session
+  open_entry *openEntries;
+  unsigned short bytesPerSector, reservedSectorCount, fsinfo;
+  unsigned char sectorsPerCluster, numFATs;
+  // both sizes are powers of two, offsets split into sector or cluster
+  // and position within it by shifting and masking
+  unsigned int sectorShift, clusterShift;
+  char name[8];
+
+  // commands hold lock shared to read and exclusive to modify the volume,
+  // cacheLock guards the block cache and the delta file index
+  pthread_rwlock_t lock;
+  pthread_mutex_t cacheLock;
+
+  // block cache, most recently used block at lruHead
+  cache_block **cacheTable;
+  cache_block *lruHead, *lruTail;
+  int cacheCapacity, cacheCount, cacheBuckets, cacheDirty;
+  // set by writes to the image or delta file that haven't been fsynced
+  int unsynced;
+
+  // copy-on-write delta file, overlayid is -1 when writes go to the image
+  char *overlayname;
+  int overlayid;
+  overlay_entry **overlayTable;
+  off_t overlayEnd;
+  int overlayRecords;
+} volume;
+
+volume *openVolume(char *file, int partition, char *overlay, int *error);
+off_t findPartition(int fd, int partition);
+int listPartitions(int fd, unsigned char *mbr, off_t *starts, unsigned int unit);
+int isBootSector(unsigned char *sector);
+unsigned int shiftOf(unsigned int size);
+void closeVolume(volume *v);
+int syncVolume();
+void finishCommand();
+int syncPending();
+unsigned int recountFreeClusters();
+
+// one user's view of a volume, its working directory and open files,
+// handed out by the library as a fatedit_volume
+typedef struct fatedit_volume {
+  volume *vol;
+  int ownsVolume;
+  unsigned int currentCluster;
+  fatedit_file **openFT;
+  int openFT_count;
+} session;
+
+// open file, found again through the location of its directory entry,
+// which moves with the shared entry when the file is renamed; cursor is
+// the cluster the last read ended in and cursorIndex its place in the
+// chain, reads from there on continue from it; raLast is the last cluster
+// advised for read-ahead and raEnd the place in the chain after it, the
+// window carries over from one read to the next
+struct fatedit_file {
+  session *ses;
+  open_entry *oe;
+  int mode, accessed, append;
+  unsigned int cursor, cursorIndex, cuts;
+  unsigned int raLast, raEnd;
+};
+
+session *openSession(volume *v);
+void closeSession(session *s);
+void enterSession(session *s, int exclusive);
+void leaveSession(session *s);
+fatedit_file *findOpenFile(off_t entryOffset);
+open_entry *findOpenEntry(off_t offset);
+open_entry *holdEntry(off_t offset, char *entry);
+void releaseEntry(open_entry *oe);
+int flushEntry(open_entry *oe);
+int flushOpenEntries();
+void closeFile(fatedit_file *f);
+int resizeFile(open_entry *oe, unsigned int size, int shrink);
+void readAheadFile(fatedit_file *f, unsigned int cluster, unsigned int index,
+                   unsigned int clusters);
+
+/*** DIRECTORIES ***/
+// position while walking the entries of a directory's cluster chain
+typedef struct {
+  unsigned int cluster;
+  off_t offset, end;
+  char *entry;
+  char data[MAX_SSIZE];
+} dir_cursor;
+
+off_t clusterOffset(unsigned int cluster);
+unsigned int entryCluster(char *entry);
+void setEntryCluster(char *entry, unsigned int cluster);
+void dirOpen(dir_cursor *c, unsigned int cluster);
+int dirNext(dir_cursor *c);
+int matchEntries(char *entries, int count, char *pattern, char *mask);
+int matchEntriesScalar(char *entries, int count, char *pattern, char *mask);
+#ifdef HAVE_SSE2
+int matchEntriesSSE2(char *entries, int count, char *pattern, char *mask);
+int matchEntriesAVX2(char *entries, int count, char *pattern, char *mask)
+  __attribute__((target("avx2")));
+#endif
+int findEntry(unsigned int dirCluster, char *shortname, char *entry, off_t *offset);
+int addEntry(unsigned int dirCluster, char *entry, off_t *offset);
+void removeEntry(off_t offset, int erase);
+unsigned char lfnChecksum(char *shortname);
+int compactDirectory(unsigned int dirCluster, int threshold, unsigned int *released);
+int resolvePath(session *s, const char *path, unsigned int *dirCluster, char *shortname);
+void tidyDirectory(session *s, const char *path);
+int lookupPath(session *s, const char *path, char *entry, off_t *offset);
+void fillStat(char *entry, off_t offset, fatedit_info *st);
+long long decodeTimestamp(char *date, char *time);
+void encodeTimestamp(time_t seconds, char *date, char *time);
+void stampEntry(char *entry, int fields);
+
+/*** WALKS ***/
+// directory waiting to be listed by a walk worker
+typedef struct walk_item {
+  unsigned int cluster;
+  char *path;
+  struct walk_item *next;
+} walk_item;
+
+// subtree walk shared by its workers, pending counts queued directories
+// plus the ones being listed
+typedef struct {
+  volume *vol;
+  walk_item *head, *tail;
+  int pending, stopped;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  fatedit_visit visit;
+  void *arg;
+} walk_state;
+
+// find and du filters and totals, shared by the walk workers
+typedef struct {
+  char *name;
+  char type;
+  char sizeOp;
+  unsigned int size;
+  int du;
+  FILE *out;
+  pthread_mutex_t lock;
+  unsigned long long files, dirs, bytes, allocated;
+  unsigned int bytesPerCluster;
+} find_query;
+
+void walkPush(walk_state *w, unsigned int cluster, char *path);
+void *walkWorker(void *arg);
+int findVisit(const char *path, const fatedit_info *info, void *arg);
+
+/*** DAEMON ***/
+// connected client served by its own thread, with a session per image
+typedef struct {
+  int fd;
+  session **sessions;
+  int numSessions;
+} daemon_client;
+
+int fat_daemon(char *socket_path);
+int fat_remote(char *socket_path, char *image, int partition);
+volume *findVolume(char *path, int partition);
+char *runCommand(char *line, size_t *len);
+void *serveClient(void *arg);
+int handleRequest(daemon_client *client);
+int sendAll(int fd, char *data, size_t len);
+int recvAll(int fd, char *data, size_t len);
+void daemonStop(int sig);
+
+// volume and session the current thread's command operates on
+static __thread volume *vol;
+static __thread session *ses;
+
+// image options applied to every volume opened
+static int cacheBlocks = CACHE_BLOCKS;
+
+// write-back mode lets up to dirtyLimit sectors collect between commands,
+// 0 writes back after every command; syncMode is 0, SYNC_FSYNC or
+// SYNC_FDATASYNC for what syncVolume asks of the kernel
+static int dirtyLimit;
+static int syncMode;
+static int walkThreads = WALK_THREADS;
+// directories are compacted once a removal leaves them with this many free
+// slots, 0 leaves them to the compact command
+static int compactThreshold;
+static char *overlayOption;
+static int partitionOption;
+
+// images kept open by the daemon
+static volume **volumes;
+static int numVolumes;
+static pthread_mutex_t volumesLock = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t daemon_alive;
+
+// io_uring submission and completion rings, fd is -1 when unavailable
+#ifdef HAVE_IO_URING
+typedef struct {
+  int fd;
+  unsigned int *sqHead, *sqTail, *sqMask, *sqArray;
+  unsigned int *cqHead, *cqTail, *cqMask;
+  unsigned int entries;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+} io_ring;
+static io_ring ring = { -1 };
+#endif
+static pthread_mutex_t ringLock = PTHREAD_MUTEX_INITIALIZER;
+
+// mkfs parameters and in-memory FAT for the volume being formatted
 typedef struct {
-  char name[11];
-  char attr;
-  int mode;
-  unsigned int firstCluster;
-} open_file;
-open_file *openFT;
-int openFT_count;
+  unsigned int sizeMB;
+  unsigned short bytesPerSector;
+  unsigned char sectorsPerCluster;
+  unsigned char numFATs;
+  int populate;
+  unsigned int seed;
+  int depth;
+  int subdirs;
+  int files;
+} mkfs_options;
+static mkfs_options mkfsOpts;
+static unsigned int *mkfsFAT;
+static unsigned int mkfsNextCluster, mkfsClusterCount, mkfsState;
 
 /*** MAIN FUNCTION ***/
+#ifndef LIBFATEDIT
 int main(int argc, char **argv) {
+  int opt, mkfs, useUring;
+  char *daemon_socket, *remote_socket;
+
+  out = stdout;
+  mkfs = 0;
+  useUring = 0;
+  daemon_socket = remote_socket = NULL;
+  mkfsOpts.sizeMB = MKFS_SIZE_MB;
+  mkfsOpts.bytesPerSector = 512;
+  mkfsOpts.sectorsPerCluster = 1;
+  mkfsOpts.numFATs = 2;
+  mkfsOpts.populate = 0;
+  mkfsOpts.seed = 1;
+  mkfsOpts.depth = 2;
+  mkfsOpts.subdirs = 4;
+  mkfsOpts.files = 8;
+
+  // parse options
+  while ((opt = getopt(argc, argv, "D:R:o:p:uC:r:j:B:Y:K:ms:c:f:S:t:d:w:n:")) != -1) {
+    switch (opt) {
+      case 'D': daemon_socket = optarg; break;
+      case 'R': remote_socket = optarg; break;
+      case 'o': overlayOption = optarg; break;
+      case 'p': partitionOption = atoi(optarg); break;
+      case 'u': useUring = 1; break;
+      case 'C': cacheBlocks = atoi(optarg); break;
+      case 'r': readAheadClusters = atoi(optarg); break;
+      case 'j': walkThreads = atoi(optarg); break;
+      case 'B': dirtyLimit = atoi(optarg); break;
+      case 'K': compactThreshold = atoi(optarg); break;
+      case 'Y':
+        if (strcmp(optarg,"fsync") == 0)
+          syncMode = SYNC_FSYNC;
+        else if (strcmp(optarg,"fdatasync") == 0)
+          syncMode = SYNC_FDATASYNC;
+        else {
+          usage();
+          exit(1);
+        }
+        break;
+      case 'm': mkfs = 1; break;
+      case 's': mkfsOpts.bytesPerSector = atoi(optarg); break;
+      case 'c': mkfsOpts.sectorsPerCluster = atoi(optarg); break;
+      case 'f': mkfsOpts.numFATs = atoi(optarg); break;
+      case 'S': mkfsOpts.sizeMB = atoi(optarg); break;
+      case 't': mkfsOpts.populate = 1; mkfsOpts.seed = atoi(optarg); break;
+      case 'd': mkfsOpts.depth = atoi(optarg); break;
+      case 'w': mkfsOpts.subdirs = atoi(optarg); break;
+      case 'n': mkfsOpts.files = atoi(optarg); break;
+      default: usage(); return 0;
+    }
+  }
+
   // check for proper argument syntax
-  if (argc != 2) {
-    printf("Bad argument syntax.\n");
-    printf("Usage: fat-edit <fs_image.img>\n");
+  if (argc - optind != (daemon_socket != NULL ? 0 : 1) ||
+      (daemon_socket != NULL && overlayOption != NULL)) {
+    usage();
     return 0;
   }
 
+  // send commands to a running daemon
+  if (remote_socket != NULL)
+    return fat_remote(remote_socket, argv[optind], partitionOption);
+
+  // set up the asynchronous I/O engine
+  if (useUring && ioInit() != 0)
+    fprintf(out, "fat-edit: io_uring unavailable, using pread/pwrite.\n");
+
+  // serve many images over a socket
+  if (daemon_socket != NULL)
+    return fat_daemon(daemon_socket);
+
+  // format a new image instead of editing one
+  if (mkfs)
+    return fat_mkfs(argv[optind]);
+
   // initialize environment
-  init_env(argv[1]);
+  init_env(argv[optind]);
 
   while (stay_alive) {
     clear_buffer();
     prompt();
     read_input();
-    if (strlen(buffer) != 0) {
+    if (command != NULL) {
       execute();
+      finishCommand();
     }
   }
 
+  // files left open get their entries written on the way out
+  fatedit_close(ses);
+
   return 0;
 }
+#endif
 
 /** init_env - initializes the working environment for the FAT32 utility
  **/
 void init_env(char* file) {
-  char temp[4];
+  int error;
 
   username = getenv("USER");
-  imagename = file;
 
   buffer = NULL;
   stay_alive = 1;
 
   // open file image
-  imageid = open(imagename, O_RDWR);
-  // seek to boot sector
-  seekTo(0);
+  ses = fatedit_open_partition(file, partitionOption, overlayOption, &error);
+  if (ses == NULL) {
+    if (error == FATEDIT_EOVERLAY)
+      fprintf(out, "fat-edit: Unable to open overlay %s.\n", overlayOption);
+    else
+      fprintf(out, "fat-edit: Unable to open %s as a FAT32 image.\n", file);
+    exit(1);
+  }
+  vol = ses->vol;
+}
+
+/** openVolume - opens an image, or a partition of a disk image, reads its
+                 boot sector and sets up its caches, returns NULL and sets
+                 error when the image can't be used
+ **/
+volume *openVolume(char *file, int partition, char *overlay, int *error) {
+  char bootsector[LCD_SSIZE];
+  unsigned int signature;
+
+  vol = (volume*)calloc(1, sizeof(volume));
+  vol->imagename = strdup(file);
+  vol->overlayid = -1;
+
+  // open file image, read-only when writes go to an overlay
+  vol->imageid = open(vol->imagename, overlay != NULL ? O_RDONLY : O_RDWR);
+  if (vol->imageid >= 0) {
+    vol->partition = partition;
+    vol->base = findPartition(vol->imageid, partition);
+  }
   // read in boot sector bytes
-  read(imageid, psector, LCD_SSIZE);
+  if (vol->imageid < 0 || vol->base < 0 ||
+      pread(vol->imageid, bootsector, LCD_SSIZE, vol->base) != LCD_SSIZE) {
+    *error = vol->imageid < 0 ? FATEDIT_EIO : FATEDIT_EBADIMG;
+    if (vol->imageid >= 0)
+      close(vol->imageid);
+    free(vol->imagename);
+    free(vol);
+    return vol = NULL;
+  }
 
   // copy over information from the appropriate offsets
-  memcpy(name,&psector[3],8);      
-  memcpy(&bytesPerSector, &psector[11], 2);
-  memcpy(&sectorsPerCluster, &psector[13], 1);
-  memcpy(&reservedSectorCount, &psector[14], 2);
-  memcpy(&numFATs, &psector[16], 1);
-  memcpy(&numTotalSectors, &psector[32], 4);
-  memcpy(&sizeFAT, &psector[36], 4);
-  memcpy(&rootCluster, &psector[44], 4);
-  memcpy(&fsinfo, &psector[48], 2);
+  memcpy(vol->name,&bootsector[3],8);      
+  memcpy(&vol->bytesPerSector, &bootsector[11], 2);
+  memcpy(&vol->sectorsPerCluster, &bootsector[13], 1);
+  memcpy(&vol->reservedSectorCount, &bootsector[14], 2);
+  memcpy(&vol->numFATs, &bootsector[16], 1);
+  memcpy(&vol->numTotalSectors, &bootsector[32], 4);
+  memcpy(&vol->sizeFAT, &bootsector[36], 4);
+  memcpy(&vol->rootCluster, &bootsector[44], 4);
+  memcpy(&vol->fsinfo, &bootsector[48], 2);
+
+  // reject anything that doesn't look like a FAT32 boot sector
+  if (vol->bytesPerSector < 512 || vol->bytesPerSector > MAX_SSIZE ||
+      (vol->bytesPerSector & (vol->bytesPerSector-1)) != 0 ||
+      vol->sectorsPerCluster == 0 ||
+      (vol->sectorsPerCluster & (vol->sectorsPerCluster-1)) != 0 ||
+      vol->numFATs == 0 || vol->sizeFAT == 0 ||
+      (unsigned long long)vol->numFATs*vol->sizeFAT + vol->reservedSectorCount >=
+      vol->numTotalSectors) {
+    *error = FATEDIT_EBADIMG;
+    close(vol->imageid);
+    free(vol->imagename);
+    free(vol);
+    return vol = NULL;
+  }
 
   // minor calculations
-  bytesPerCluster = sectorsPerCluster*bytesPerSector;
-  nextFreeLocation = 0;
+  vol->bytesPerCluster = vol->sectorsPerCluster*vol->bytesPerSector;
+  vol->sectorShift = shiftOf(vol->bytesPerSector);
+  vol->clusterShift = shiftOf(vol->bytesPerCluster);
 
   // calculate the location of the root directory
-  firstDataSector = reservedSectorCount + ((int)numFATs * sizeFAT);
-  rootLoc = firstSectorOfCluster(rootCluster);
-  currentCluster = rootCluster;
+  vol->firstDataSector = vol->reservedSectorCount + vol->numFATs*vol->sizeFAT;
+  vol->rootLoc = firstSectorOfCluster(vol->rootCluster);
+  vol->numClusters = (vol->numTotalSectors - vol->firstDataSector) / vol->sectorsPerCluster;
+
+  // start or resume a copy-on-write session
+  if (overlay != NULL && overlayOpen(overlay) != 0) {
+    *error = FATEDIT_EOVERLAY;
+    if (vol->overlayid >= 0)
+      close(vol->overlayid);
+    close(vol->imageid);
+    free(vol->imagename);
+    free(vol);
+    return vol = NULL;
+  }
 
-  // free cluster information
-  seekTo(fsinfo*bytesPerSector + 488);
-  read(imageid, temp, 4);
-  memcpy(&numFreeSectors, &temp, 4);
+  // commands and the cache may be used from several threads
+  pthread_rwlock_init(&vol->lock, NULL);
+  pthread_mutex_init(&vol->cacheLock, NULL);
 
-  // seek to the root directory
-  seekTo(rootLoc*bytesPerSector);
-  // read in the root directory
-  read(imageid, psector, LCD_SSIZE);
+  // set up the block cache now that the sector size is known
+  cacheInit(cacheBlocks);
 
-  // initialize open file table
-  openFT = NULL;
-  openFT_count = 0;
+  // free cluster information, volumes without a valid FSInfo sector get
+  // counted once and are never written an FSInfo
+  signature = 0;
+  if (vol->fsinfo != 0 && vol->fsinfo < vol->reservedSectorCount)
+    readImage(vol->fsinfo*vol->bytesPerSector, &signature, 4);
+  if (signature != 0x41615252)
+    vol->fsinfo = 0;
+  else {
+    readImage(vol->fsinfo*vol->bytesPerSector + 488, &vol->freeClusters, 4);
+    readImage(vol->fsinfo*vol->bytesPerSector + 492, &vol->nextFreeLocation, 4);
+  }
+  if (vol->fsinfo == 0 || vol->freeClusters > vol->numClusters)
+    recountFreeClusters();
+  if (vol->nextFreeLocation < 2 || vol->nextFreeLocation >= vol->numClusters+2)
+    vol->nextFreeLocation = 2;
+  vol->fsInfoDirty = 0;
+
+  *error = FATEDIT_OK;
+  return vol;
 }
 
-/** prompt - prints out an informative prompt for the user
+/** findPartition - returns the byte offset of a partition of a disk
+                    image from its MBR or GPT, partition 0 is the image
+                    itself when it starts with a boot sector and otherwise
+                    the first partition that does, -1 if there's no such
+                    partition
  **/
-void prompt() {
-  printf("%s(%s)> ",username,imagename);
+off_t findPartition(int fd, int partition) {
+  unsigned char mbr[LCD_SSIZE], sector[LCD_SSIZE];
+  off_t starts[MAX_PARTITIONS];
+  unsigned int unit;
+  int count, i;
+
+  if (pread(fd, mbr, LCD_SSIZE, 0) != LCD_SSIZE)
+    return partition == 0 ? 0 : -1;
+  // a bare volume, or something openVolume will reject on its own
+  if (isBootSector(mbr) || mbr[510] != 0x55 || mbr[511] != 0xAA)
+    return partition == 0 ? 0 : -1;
+
+  // MBR addresses are in the disk's logical sectors, which only the boot
+  // sector found at the resulting offset can confirm
+  for (unit = 512; unit <= MAX_SSIZE; unit *= 8) {
+    count = listPartitions(fd, mbr, starts, unit);
+    for (i = 0; i < count; i++) {
+      if ((partition == 0 || partition == i+1) && starts[i] != 0 &&
+          pread(fd, sector, LCD_SSIZE, starts[i]) == LCD_SSIZE && isBootSector(sector))
+        return starts[i];
+    }
+  }
+
+  return -1;
 }
 
-/** read_input - reads input from the user and parses it accordingly
+/** listPartitions - fills starts with the byte offset of each partition
+                     numbered the way Linux does, primary MBR slots 1-4,
+                     logical partitions from 5 and GPT entries in table
+                     order, 0 for unused numbers, returns how many numbers
+                     were filled; MBR addresses count unit byte sectors
  **/
-void read_input() {
-  buffer = (char*)malloc((BUFFER_SIZE+1)*sizeof(char));
-  fgets(buffer,BUFFER_SIZE,stdin);
+int listPartitions(int fd, unsigned char *mbr, off_t *starts, unsigned int unit) {
+  unsigned char header[LCD_SSIZE], entry[128], ebr[LCD_SSIZE];
+  unsigned long long tableLBA, firstLBA;
+  unsigned int lba, numEntries, entrySize, extended, next, sectorSize;
+  int count, i, j;
+
+  memset(starts, 0, MAX_PARTITIONS*sizeof(off_t));
+
+  // a protective MBR hands over to the GPT, whose header follows the
+  // first logical sector of either size
+  for (i = 0; i < 4 && mbr[446 + 16*i + 4] != MBR_PROTECTIVE; i++);
+  if (i < 4) {
+    for (sectorSize = 512; sectorSize <= MAX_SSIZE; sectorSize *= 8) {
+      if (pread(fd, header, LCD_SSIZE, sectorSize) == LCD_SSIZE &&
+          memcmp(header, GPT_SIGNATURE, 8) == 0)
+        break;
+    }
+    if (sectorSize > MAX_SSIZE)
+      return 0;
 
-  // remove tail newline/return
-  int i;
-  for (i = 0; i < BUFFER_SIZE; i++) {
-    if (buffer[i] == '\n' || buffer[i] == '\r')
-      buffer[i] = 0;
+    memcpy(&tableLBA, &header[72], 8);
+    memcpy(&numEntries, &header[80], 4);
+    memcpy(&entrySize, &header[84], 4);
+    if (entrySize < 48 || entrySize > sizeof(entry))
+      return 0;
+    count = numEntries < MAX_PARTITIONS ? numEntries : MAX_PARTITIONS;
+    for (i = 0; i < count; i++) {
+      if (pread(fd, entry, entrySize, (off_t)tableLBA*sectorSize + (off_t)i*entrySize) !=
+          (ssize_t)entrySize)
+        return i;
+      // an all zero type GUID marks an unused entry
+      for (j = 0; j < 16 && entry[j] == 0; j++);
+      memcpy(&firstLBA, &entry[32], 8);
+      if (j < 16)
+        starts[i] = (off_t)firstLBA*sectorSize;
+    }
+    return count;
   }
 
-  // parse command and arguments
-  char *token, *temp;
-  temp = NULL;
-  for (i = 0, token = strtok(strdup(buffer)," ");
-       token != NULL;
-       token = strtok(NULL," "), i++) {
-    // first token is command
-    if (i == 0) {
-      command = strdup(token);
+  count = 4;
+  extended = 0;
+  for (i = 0; i < 4; i++) {
+    memcpy(&lba, &mbr[446 + 16*i + 8], 4);
+    switch (mbr[446 + 16*i + 4]) {
+      case 0x00: break;
+      // extended partitions hold a chain of logical ones
+      case 0x05: case 0x0F: case 0x85: extended = lba; break;
+      default: starts[i] = (off_t)lba*unit; break;
     }
-    // check for invalid character
-    else if (i == 1 && strchr(token,'/') != NULL) {
-      printf("fat-edit: Invalid character \'/\' detected.\n");
-      free(buffer);
-      buffer = (char*)malloc(sizeof(char));
-      buffer[0] = 0;
-      return;
-    }
-    // other tokens are arguments
-    else {
-      // check for quoted data
-      if (token[0] == '"') {
-        temp = (char*)malloc(strlen(token)*sizeof(char));
-        strcpy(temp,token+1);
-        if (temp[strlen(temp)-1] != '"') {
-          temp[strlen(token+1)] = ' ';
-          token = strtok(NULL,"\"");
-          temp = (char*)realloc(temp,(strlen(temp)+strlen(token)+1)*sizeof(char));
-          strcat(temp,token);
-        }
-        else
-          temp[strlen(temp)-1] = 0;
-        token = temp;
-        strtok(NULL," ");
-      }
+  }
 
-      // make room for argument
-      command_args = (char**)realloc(command_args,++num_command_args*sizeof(char*));
-      command_args[i-1] = strdup(token);
-    }
+  // each EBR describes one logical partition, relative to itself, and
+  // links to the next EBR, relative to the extended partition
+  for (next = extended; next != 0 && count < MAX_PARTITIONS; count++) {
+    if (pread(fd, ebr, LCD_SSIZE, (off_t)next*unit) != LCD_SSIZE ||
+        ebr[510] != 0x55 || ebr[511] != 0xAA)
+      break;
+    memcpy(&lba, &ebr[446 + 8], 4);
+    if (ebr[446 + 4] != 0x00)
+      starts[count] = ((off_t)next + lba)*unit;
+    memcpy(&lba, &ebr[446 + 16 + 8], 4);
+    next = ebr[446 + 16 + 4] != 0x00 && lba != 0 ? extended + lba : 0;
   }
 
-  // free temp string if used
-  if (temp != NULL)
-    free(temp);
+  return count;
 }
 
-/** clear_buffer - empties the input buffer for the next input
+/** isBootSector - checks whether a sector looks like a FAT32 boot sector
+                   rather than an MBR
  **/
-void clear_buffer() {
-  free(buffer);
-  buffer = NULL;
+int isBootSector(unsigned char *sector) {
+  unsigned short bytesPerSector;
+  unsigned int sizeFAT;
 
-  free(command);
-  command = NULL;
+  memcpy(&bytesPerSector, &sector[11], 2);
+  memcpy(&sizeFAT, &sector[36], 4);
 
-  int i;
-  for (i = num_command_args-1; i >= 0; i--) {
-    free(command_args[i]);
-    command_args[i] = NULL;
-  }
-  num_command_args = 0;
+  return (sector[0] == 0xEB || sector[0] == 0xE9) &&
+         bytesPerSector >= 512 && bytesPerSector <= MAX_SSIZE &&
+         (bytesPerSector & (bytesPerSector-1)) == 0 &&
+         sector[13] != 0 && sector[16] != 0 && sizeFAT != 0;
+}
+
+/** shiftOf - returns log2 of a power of two size
+ **/
+unsigned int shiftOf(unsigned int size) {
+  unsigned int shift;
 
-  command_args = (char**)malloc(sizeof(char*));
-  command_args[0] = NULL;
+  for (shift = 0; (1U << shift) < size; shift++);
+  return shift;
 }
 
-/** execute - determines the proper command and prints out result output
+/** closeVolume - writes back and closes an image and frees its caches
  **/
-void execute() {
-  int result;
-  char *open_mode;
+void closeVolume(volume *v) {
+  open_entry *oe;
+  overlay_entry *entry;
+  int i;
 
-  // exit
-  if (strcmp(command,"exit") == 0) {
-    if (num_command_args != 0)
-      usage_error("exit");
-    else
-      stay_alive = 0;
-  }
-  // fsinfo
-  else if (strcmp(command,"fsinfo") == 0) {
-    if (num_command_args != 0)
-      usage_error("fsinfo");
-    else {
-      fat_info();
-    }
-  }
-  // open
-  else if (strcmp(command,"open") == 0) {
-    if (num_command_args != 2)
-      usage_error("open");
-    else {
-      result = fat_open(command_args[0],command_args[1]);
-      switch (result) {
-        case 0: if (strcmp(command_args[1],"r") == 0) open_mode = "reading";
-                else if (strcmp(command_args[1],"w") == 0) open_mode = "writing";
-                else if (strcmp(command_args[1],"rw") == 0 ||
-                         strcmp(command_args[1],"wr") == 0) open_mode = "reading and writing";
-                printf("%s has been opened for %s.\n",command_args[0],open_mode);
-                break;
-        case 1: printf("fat-edit: open: %s doesn't exist.\n",command_args[0]); break;
-        case 2: printf("fat-edit: open: %s is already open.\n",command_args[0]); break;
-        case 3: printf("fat-edit: open: %s is not a file.\n",command_args[0]); break;
-        case 4: printf("fat-edit: open: Invalid open mode.\n"); break;
-        case 5: printf("fat-edit: open: Permission denied - file is read-only.\n"); break;
-        default: break;
-      }
-    }
-  }
-  // close
-  else if (strcmp(command,"close") == 0) {
-    if (num_command_args != 1)
-      usage_error("close");
-    else {
-      result = fat_close(command_args[0]);
-      switch (result) {
-        case 0: printf("%s has been closed.\n",command_args[0]); break;
-        case 1: printf("fat-edit: close: %s doesn't exist.\n",command_args[0]); break;
-        case 2: printf("fat-edit: close: %s isn't open.\n",command_args[0]); break;
-        case 3: printf("fat-edit: close: %s is not a file.\n",command_args[0]); break;
-        default: break;
-      }
-    }
-  }
-  // create
-  else if (strcmp(command,"create") == 0) {
-    if (num_command_args != 1)
-      usage_error("create");
-    else {
-      result = fat_create(command_args[0]);
-      switch (result) {
-        case 1: printf("fat-edit: create: %s already exists.\n",command_args[0]); break;
-        case 2: printf("fat-edit: create: %s is a directory.\n",command_args[0]); break;
-        case 3: printf("fat-edit: create: FAT32 volume ran out of space.\n"); break;
-        default: break;
-      }
-    }
-  }
-  // read
-  else if (strcmp(command,"read") == 0) {
-    if (num_command_args != 3)
-      usage_error("read");
-    else {
-      result = fat_read(command_args[0],atoi(command_args[1]),atoi(command_args[2]));
-      switch (result) {
-        case 1: printf("fat-edit: read: %s doesn't exist.\n",command_args[0]); break;
-        case 2: printf("fat-edit: read: %s isn't open.\n",command_args[0]); break;
-        case 3: printf("fat-edit: read: %s doesn't have read permission.\n",command_args[0]); break;
-        case 4: printf("fat-edit: read: %s is not a file.\n",command_args[0]); break;
-        case 5: printf("fat-edit: read: Start position beyond EoF.\n"); break;
-        default: break;
-      }
-    }
-  }
-  // write
-  else if (strcmp(command,"write") == 0) {
-    if (num_command_args != 3)
-      usage_error("write");
-    else {
-      result = fat_write(command_args[0],atoi(command_args[1]),command_args[2]);
-      switch (result) {
-        case 0: printf("Wrote \"%s\" @ %d of length %d to %s\n",command_args[2],
-                                                                atoi(command_args[1]),
-                                                                (int)strlen(command_args[2]),
-                                                                command_args[0]);
-                                                                break;
-        case 1: printf("fat-edit: write: %s doesn't exist.\n",command_args[0]); break;
-        case 2: printf("fat-edit: write: %s isn't open.\n",command_args[0]); break;
-        case 3: printf("fat-edit: write: %s doesn't have write permission.\n",command_args[0]); break;
-        case 4: printf("fat-edit: write: %s is not a file.\n",command_args[0]); break;
-        case 5: printf("fat-edit: write: Start position beyond EoF.\n"); break;
-        case 6: printf("fat-edit: write: FAT32 volume ran out of space.\n"); break;
-        default: break;
-      }
-    }
-  }
-  // rm
-  else if (strcmp(command,"rm") == 0) {
-    if (num_command_args != 1)
-      usage_error("rm");
-    else {
-      result = fat_rm(command_args[0],0);
-      switch (result) {
-        case 1: printf("fat-edit: rm: %s doesn't exist.\n",command_args[0]); break;
-        case 2: printf("fat-edit: rm: %s is a directory.\n",command_args[0]); break;
-        default: break;
-      }
-    }
-  }
-  // srm
-  else if (strcmp(command,"srm") == 0) {
-    if (num_command_args != 1)
-      usage_error("srm");
-    else {
-      result = fat_rm(command_args[0],1);
-      switch (result) {
-        case 1: printf("fat-edit: srm: %s doesn't exist.\n",command_args[0]); break;
-        case 2: printf("fat-edit: srm: %s is a directory.\n",command_args[0]); break;
-        default: break;
-      }
-    }
-  }
-  // cd
-  else if (strcmp(command,"cd") == 0) {
-    if (num_command_args != 1)
-      usage_error("cd");
-    // check if parent call is in root already
-    else if (strcmp(command_args[0],"..") == 0 &&
-             currentCluster == rootCluster)
-      printf("fat-edit: cd: Root directory has no parent.\n");
-    else {
-      result = fat_cd(command_args[0]);
-      switch (result) {
-        case 1: printf("fat-edit: cd: %s doesn't exist.\n",command_args[0]); break;
-        case 2: printf("fat-edit: cd: %s is not a directory.\n",command_args[0]); break;
-        default: break;
-      }
-    }
+  vol = v;
+  flushOpenEntries();
+  while (v->openEntries != NULL) {
+    oe = v->openEntries;
+    v->openEntries = oe->next;
+    free(oe);
   }
-  // ls
-  else if (strcmp(command,"ls") == 0) {
-    if (num_command_args != 1)
-      usage_error("ls");
-    // check if parent call is in root already
-    else if (strcmp(command_args[0],"..") == 0 &&
-             currentCluster == rootCluster)
-      printf("fat-edit: ls: Root directory has no parent.\n");
-    else {
-      result = fat_ls(command_args[0]);
-      switch (result) {
-        case 1: printf("fat-edit: ls: %s doesn't exist.\n",command_args[0]); break;
-        case 2: printf("fat-edit: ls: %s is not a directory.\n",command_args[0]); break;
-        default: break;
+  syncVolume();
+  cacheInvalidate();
+  free(v->cacheTable);
+  if (v->overlayid >= 0) {
+    for (i = 0; i < OVERLAY_BUCKETS; i++) {
+      while ((entry = v->overlayTable[i]) != NULL) {
+        v->overlayTable[i] = entry->next;
+        free(entry);
       }
     }
+    close(v->overlayid);
   }
-  // mkdir
-  else if (strcmp(command,"mkdir") == 0) {
-    if (num_command_args != 1)
-      usage_error("mkdir");
-    else {
-      result = fat_mkdir(command_args[0]);
-      switch (result) {
-        case 1: printf("fat-edit: mkdir: %s is already a file.\n",command_args[0]); break;
-        case 2: printf("fat-edit: mkdir: %s already exists.\n",command_args[0]); break;
-        case 3: printf("fat-edit: mkdir: FAT32 volume ran out of space.\n"); break;
-        default: break;
-      }
-    }
+  free(v->overlayTable);
+  close(v->imageid);
+  pthread_rwlock_destroy(&v->lock);
+  pthread_mutex_destroy(&v->cacheLock);
+  free(v->imagename);
+  free(v);
+}
+
+/** syncVolume - writes the FSInfo counters and every dirty sector back,
+                 then fsyncs or fdatasyncs the file written to if syncMode
+                 asks for it
+ **/
+int syncVolume() {
+  unsigned int info[2];
+  int failed, fd;
+
+  if (vol->fsInfoDirty && vol->fsinfo != 0) {
+    vol->fsInfoDirty = 0;
+    info[0] = vol->freeClusters;
+    info[1] = vol->nextFreeLocation;
+    writeImage(vol->fsinfo*vol->bytesPerSector + 488, info, 8);
   }
-  // rmdir
-  else if (strcmp(command,"rmdir") == 0) {
-    if (num_command_args != 1)
-      usage_error("rmdir");
-    else if (strcmp(command_args[0],".") == 0)
-      printf("fat-edit: rm: Cannot delete current working directory.\n");
-    else if (strcmp(command_args[0],"..") == 0)
-      printf("fat-edit: rm: Cannot delete parent directory.\n");
-    else {
-      result = fat_rmdir(command_args[0]);
-      switch (result) {
-        case 1: printf("fat-edit: rmdir: %s doesn't exist.\n",command_args[0]); break;
-        case 2: printf("fat-edit: rmdir: %s is not a directory.\n",command_args[0]); break;
-        case 3: printf("fat-edit: rmdir: %s is not empty.\n",command_args[0]); break;
-        default: break;
-      }
-    }
+
+  failed = cacheFlush();
+  if (syncMode != 0 && vol->unsynced) {
+    fd = vol->overlayid >= 0 ? vol->overlayid : vol->imageid;
+    if ((syncMode == SYNC_FDATASYNC ? fdatasync(fd) : fsync(fd)) != 0)
+      failed = 1;
+    vol->unsynced = 0;
   }
-  // size
-  else if (strcmp(command,"size") == 0) {
-    if (num_command_args != 1)
-      usage_error("size");
-    else {
-      result = fat_size(command_args[0]);
-      switch (result) {
-        case 1: printf("fat-edit: size: %s doesn't exist.\n",command_args[0]); break;
-        case 2: printf("fat-edit: size: %s is not a file.\n",command_args[0]); break;
-        default: break;
+
+  return failed;
+}
+
+/** finishCommand - writes a command's changes back, or in write-back mode
+                    only once enough have collected or the command closed
+                    a file or the session; the volume is held exclusively
+                    so other clients' commands can't change the FAT or the
+                    FSInfo counters while they are written
+ **/
+void finishCommand() {
+  int pending;
+
+  // commands that left nothing to write, reads among them, finish under
+  // the shared lock so readers don't queue behind each other here
+  enterSession(ses, 0);
+  pending = syncPending();
+  leaveSession(ses);
+  if (!pending)
+    return;
+
+  enterSession(ses, 1);
+  if (syncPending())
+    syncVolume();
+  leaveSession(ses);
+}
+
+/** syncPending - tells whether the command just run leaves changes that
+                  finishCommand has to write back now
+ **/
+int syncPending() {
+  int dirty, pending;
+
+  // readers holding the volume shared may write dirty sectors back too,
+  // the counters they touch are guarded with the cache
+  pthread_mutex_lock(&vol->cacheLock);
+  dirty = vol->cacheDirty;
+  pending = dirty != 0 || vol->fsInfoDirty || vol->unsynced;
+  pthread_mutex_unlock(&vol->cacheLock);
+
+  return pending && (dirtyLimit == 0 || dirty >= dirtyLimit ||
+                     strcmp(command,"close") == 0 || strcmp(command,"exit") == 0);
+}
+
+/** recountFreeClusters - rebuilds the free cluster count and hint from the
+                          FAT, reading it past the cache in large blocks
+ **/
+unsigned int recountFreeClusters() {
+  io_request req;
+  unsigned int *entries, cluster, end, count, i;
+  off_t FATLoc;
+
+  entries = (unsigned int*)malloc(FAT_SCAN_BYTES);
+  FATLoc = (off_t)vol->reservedSectorCount*vol->bytesPerSector;
+  end = vol->numClusters+2;
+  vol->freeClusters = 0;
+  vol->nextFreeLocation = 0;
+
+  for (cluster = 0; cluster < end; cluster += count) {
+    count = end - cluster;
+    if (count > FAT_SCAN_BYTES/4)
+      count = FAT_SCAN_BYTES/4;
+    req.write = 0;
+    req.buf = (char*)entries;
+    req.len = count*4;
+    req.offset = FATLoc + (off_t)cluster*4;
+    if (ioBatch(&req, 1) != 0)
+      break;
+
+    // the first two entries are reserved
+    for (i = cluster < 2 ? 2 - cluster : 0; i < count; i++) {
+      if ((entries[i] & 0x0FFFFFFF) == EMPTY) {
+        if (vol->freeClusters++ == 0)
+          vol->nextFreeLocation = cluster + i;
       }
     }
   }
-  // unknown command
-  else {
-    printf("fat-edit: Command not found: %s\n",command);
-  }
+  free(entries);
+
+  if (vol->nextFreeLocation == 0)
+    vol->nextFreeLocation = 2;
+  vol->fsInfoDirty = 1;
+
+  return vol->freeClusters;
 }
 
-/** usage_error - prints out an error upon improper argument usage
-                  for a given command
+/** openSession - starts a session in the root directory of a volume
  **/
-void usage_error(char *cmd) {
-  printf("fat-edit: %s: Improper argument usage.\n",cmd);
+session *openSession(volume *v) {
+  session *s;
+
+  s = (session*)calloc(1, sizeof(session));
+  s->vol = v;
+  s->currentCluster = v->rootCluster;
+  s->openFT = NULL;
+  s->openFT_count = 0;
+
+  return s;
 }
 
-/** fat_info - prints out important information relating to the FAT32 volume
+/** closeSession - drops a session, closing every file still open in it
  **/
-void fat_info() {
-  printf("Bytes per sector: %hd\n", bytesPerSector);
-  printf("Sectors per cluster: %d\n", sectorsPerCluster);
-  printf("Total number of sectors: %d\n", numTotalSectors);
-  printf("Number of free sectors: %d\n", numFreeSectors);
-  printf("Number of FATs: %d\n", numFATs);
-  printf("Sectors per FAT: %d\n", sizeFAT);
+void closeSession(session *s) {
+  enterSession(s, 1);
+  while (s->openFT_count > 0)
+    closeFile(s->openFT[0]);
+  leaveSession(s);
+
+  free(s->openFT);
+  free(s);
 }
 
-/** fat_open - open a file with the given mode
+/** enterSession - makes a session current for the calling thread and
+                   locks its volume, exclusively when the caller modifies it
  **/
-int fat_open(char *file_name, char *mode) {
-  char *filename = (char*)malloc(strlen(file_name)*sizeof(char));
-  char entry_filename[12];
-  entry_filename[11] = 0;
-  unsigned short clusHigh, clusLow;
-  char attrLongName;
-  int result, i, j, nextCluster, originalCluster;
+void enterSession(session *s, int exclusive) {
+  if (exclusive)
+    pthread_rwlock_wrlock(&s->vol->lock);
+  else
+    pthread_rwlock_rdlock(&s->vol->lock);
+  vol = s->vol;
+  ses = s;
+}
 
-  // invalid mode
-  if (strcmp(mode,"r") != 0 &&
-      strcmp(mode,"w") != 0 &&
-      strcmp(mode,"rw") != 0 &&
-      strcmp(mode,"wr") != 0) return 4;
-
-  result = -1;
-  strcpy(filename,file_name);
-  convertFilename(filename);
-  originalCluster = currentCluster;
-
-  // navigate through current directory
-  for (i = 0; i < 64 && result == -1; ++i) {
-    memcpy(&entry_filename, &psector[32*i], 11);
-    memcpy(&attrLongName, &psector[11 + 32*i], 1);
-    
-    // no more entries
-    if (entry_filename[0] == 0x00) {
-      result = 1;
-    }
-    // ignore empty entries and long entry names
-    else if (entry_filename[0] != FREE &&
-             attrLongName != LONG_DIRECTORY &&
-             strcmp(entry_filename,filename) == 0) {
-      // file is a directory
-      if (attrLongName == SUB_DIRECTORY)
-	      result = 3;
-      else if (attrLongName == READ_ONLY &&
-               strcmp(mode,"r") != 0)
-        result = 5;
-      // file found
-      else {
-        memcpy(&clusHigh, &psector[20 + 32*i], 2);
-        memcpy(&clusLow, &psector[26 + 32*i], 2);
-
-        // check if file is open already
-        for (j = 0; j < openFT_count && result == -1; j++)
-          if (openFT[j].firstCluster == combineShorts(clusHigh,clusLow))
-            result = 2;
-
-        // open file if not already open
-        if (result == -1) {
-          openFT = (open_file*)realloc(openFT,++openFT_count*sizeof(open_file));
-          memcpy(&openFT[openFT_count-1].name, &psector[32*i], 11);
-          memcpy(&openFT[openFT_count-1].attr, &psector[11 + 32*i], 1);
-          openFT[openFT_count-1].firstCluster = combineShorts(clusHigh,clusLow);
-          if (strcmp(mode,"r") == 0)
-            openFT[openFT_count-1].mode = O_RDONLY;
-          else if (strcmp(mode,"w") == 0)
-            openFT[openFT_count-1].mode = O_WRONLY;
-          else
-            openFT[openFT_count-1].mode = O_RDWR;
-
-	        result = 0;
-        }
-      }
-    }
+/** leaveSession - unlocks the volume of a session entered before
+ **/
+void leaveSession(session *s) {
+  pthread_rwlock_unlock(&s->vol->lock);
+}
 
-    // check for more clusters
-    if (i == 64-1 && result == -1) {
-      nextCluster = getNextCluster(currentCluster);
-      if (nextCluster < EoC) {
-        seekTo(firstSectorOfCluster(nextCluster)*bytesPerSector);
-        currentCluster = nextCluster;
-        read(imageid, psector, LCD_SSIZE);
-        i = 0;
-      }
-    }
+/** findOpenFile - returns the current session's open file with the given
+                   directory entry, or NULL when it isn't open
+ **/
+fatedit_file *findOpenFile(off_t entryOffset) {
+  int i;
+
+  for (i = 0; i < ses->openFT_count; i++)
+    if (ses->openFT[i]->oe->offset == entryOffset)
+      return ses->openFT[i];
+
+  return NULL;
+}
+
+/** findOpenEntry - returns the shared entry of an open file, or NULL when
+                    no session has the file open
+ **/
+open_entry *findOpenEntry(off_t offset) {
+  open_entry *oe;
+
+  // a deleted file's slot may already hold a new file
+  for (oe = vol->openEntries; oe != NULL && (oe->offset != offset || oe->deleted);
+       oe = oe->next);
+
+  return oe;
+}
+
+/** holdEntry - takes a reference on the shared entry of a file being
+                opened, starting from the entry on disk for the first one
+ **/
+open_entry *holdEntry(off_t offset, char *entry) {
+  open_entry *oe;
+
+  oe = findOpenEntry(offset);
+  if (oe == NULL) {
+    oe = (open_entry*)calloc(1, sizeof(open_entry));
+    oe->offset = offset;
+    memcpy(oe->entry, entry, 32);
+    oe->next = vol->openEntries;
+    vol->openEntries = oe;
   }
-  free(filename);
+  oe->refs++;
 
-  seekTo(firstSectorOfCluster(originalCluster)*bytesPerSector);
-  currentCluster = originalCluster;
-  read(imageid, psector, LCD_SSIZE);
+  return oe;
+}
 
-  return result;
+/** releaseEntry - drops a reference on a shared entry, forgetting it with
+                   the last one
+ **/
+void releaseEntry(open_entry *oe) {
+  open_entry **link;
+
+  if (--oe->refs > 0)
+    return;
+
+  for (link = &vol->openEntries; *link != oe; link = &(*link)->next);
+  *link = oe->next;
+  free(oe);
 }
 
-/** fat_close - closes an open file
+/** flushEntry - writes a shared entry back to its directory if it changed,
+                 unless the file was deleted meanwhile
  **/
-int fat_close(char *file_name) {
-  char *filename = (char*)malloc(strlen(file_name)*sizeof(char));
-  char entry_filename[12];
-  entry_filename[11] = 0;
-  unsigned short clusHigh, clusLow;
-  char attrLongName;
-  int result, i, j, nextCluster, originalCluster;
+int flushEntry(open_entry *oe) {
+  if (!oe->dirty || oe->deleted)
+    return 0;
 
-  result = -1;
-  strcpy(filename,file_name);
-  convertFilename(filename);
-  originalCluster = currentCluster;
+  oe->dirty = 0;
+  return writeImage(oe->offset, oe->entry, 32);
+}
 
-  // navigate through current directory
-  for (i = 0; i < 64 && result == -1; ++i) {
-    memcpy(&entry_filename, &psector[32*i], 11);
-    memcpy(&attrLongName, &psector[11 + 32*i], 1);
+/** flushOpenEntries - writes back the changed entries of every open file
+ **/
+int flushOpenEntries() {
+  open_entry *oe;
+  int failed;
 
-    // no more entries
-    if (entry_filename[0] == 0x00) {
-      result = 1;
-    }
-    // ignore empty entries and long entry names
-    else if (entry_filename[0] != FREE &&
-             attrLongName != LONG_DIRECTORY &&
-             strcmp(entry_filename,filename) == 0) {
-      // file is a directory
-      if (attrLongName == SUB_DIRECTORY)
-	      result = 3;
-      // file found
-      else {
-        memcpy(&clusHigh, &psector[20 + 32*i], 2);
-        memcpy(&clusLow, &psector[26 + 32*i], 2);
-
-        // check if file is open
-        for (j = 0; j < openFT_count && result == -1; j++)
-          if (openFT[j].firstCluster == combineShorts(clusHigh,clusLow)) {
-            int remove;
-            for (remove = j; remove < openFT_count; remove++)
-              openFT[remove] = openFT[++j];
-            openFT = (open_file*)realloc(openFT,--openFT_count*sizeof(open_file));
-            result = 0;
-          }
-
-        if (result == -1)
-          result = 2;
-      }
-    }
+  failed = 0;
+  for (oe = vol->openEntries; oe != NULL; oe = oe->next)
+    if (flushEntry(oe) != 0)
+      failed = 1;
 
-    // check for more clusters
-    if (i == 64-1 && result == -1) {
-      nextCluster = getNextCluster(currentCluster);
-      if (nextCluster < EoC) {
-        seekTo(firstSectorOfCluster(nextCluster)*bytesPerSector);
-        currentCluster = nextCluster;
-        read(imageid, psector, LCD_SSIZE);
-        i = 0;
-      }
+  return failed;
+}
+
+/** closeFile - closes a file of the current volume, stamping its access
+                date if it was read and writing its entry back
+ **/
+void closeFile(fatedit_file *f) {
+  session *s;
+  char date[2];
+  int i;
+
+  if (f->accessed && !f->oe->deleted) {
+    encodeTimestamp(time(NULL), date, NULL);
+    if (memcmp(&f->oe->entry[18], date, 2) != 0) {
+      memcpy(&f->oe->entry[18], date, 2);
+      f->oe->dirty = 1;
     }
   }
-  free(filename);
+  flushEntry(f->oe);
+  releaseEntry(f->oe);
 
-  seekTo(firstSectorOfCluster(originalCluster)*bytesPerSector);
-  currentCluster = originalCluster;
-  read(imageid, psector, LCD_SSIZE);
+  s = f->ses;
+  for (i = 0; s->openFT[i] != f; i++);
+  s->openFT[i] = s->openFT[--s->openFT_count];
+  free(f);
+}
 
-  return result;
+/** prompt - prints out an informative prompt for the user
+ **/
+void prompt() {
+  fprintf(out, "%s(%s)> ",username,vol->imagename);
 }
 
-/** fat_create - creats a new empty file in the current directory tree
+/** read_input - reads input from the user and parses it accordingly,
+                 the end of the input ends the session like exit
  **/
-int fat_create(char *file_name) {
-  char *filename = (char*)malloc(strlen(file_name)*sizeof(char));
-  char entry_filename[12];
-  entry_filename[11] = 0;
-  char attrLongName;
-  int result, i, nextCluster, originalCluster, freeEntryIndex;
-  unsigned int filesize;
-  char filesize_raw[4];
-
-  result = freeEntryIndex = -1;
-  strcpy(filename,file_name);
-  convertFilename(filename);
-  originalCluster = currentCluster;
-  filesize = 0;
-
-  // navigate through current directory
-  for (i = 0; i < 64 && result == -1; ++i) {
-    memcpy(&entry_filename, &psector[32*i], 11);
-    memcpy(&attrLongName, &psector[11 + 32*i], 1);
-    
-    // set first free entry index for creation
-    if ((entry_filename[0] == FREE || entry_filename[0] == 0x00) &&
-        freeEntryIndex == -1)
-      freeEntryIndex = i;
-
-    // ignore empty entries and long entry names
-    if (entry_filename[0] != FREE &&
-        entry_filename[0] != 0x00 &&
-        attrLongName != LONG_DIRECTORY &&
-        strcmp(entry_filename,filename) == 0) {
-
-      // file is a directory
-      if (attrLongName == SUB_DIRECTORY)
-	      result = 2;
-      // file exists already
+void read_input() {
+  buffer = (char*)arenaAlloc(BUFFER_SIZE+1);
+  if (fgets(buffer,BUFFER_SIZE,stdin) == NULL) {
+    buffer[0] = 0;
+    stay_alive = 0;
+    return;
+  }
+  parse_input();
+}
+
+/** parse_input - splits the input buffer in place into the command and its
+                  arguments, leaving command NULL when there is nothing to
+                  run; quoted data runs to the closing quote, spaces and all
+ **/
+void parse_input() {
+  char *next, *token;
+
+  command = NULL;
+  num_command_args = 0;
+  command_args = (char**)arenaAlloc(MAX_ARGS*sizeof(char*));
+
+  // remove tail newline/return
+  buffer[strcspn(buffer, "\r\n")] = 0;
+
+  for (next = buffer; *next != 0; ) {
+    while (*next == ' ')
+      next++;
+    if (*next == 0)
+      break;
+
+    // split off the next token, the command itself is never quoted
+    if (*next == '"' && command != NULL) {
+      token = ++next;
+      next = strchr(next, '"');
+      if (next == NULL)
+        next = token + strlen(token);
       else
-        result = 1;
+        *next++ = 0;
+    }
+    else {
+      token = next;
+      next += strcspn(next, " ");
+      if (*next != 0)
+        *next++ = 0;
     }
 
-    // check for more clusters
-    if (i == 64-1 && result == -1) {
-      nextCluster = getNextCluster(currentCluster);
-      if (nextCluster < EoC) {
-        seekTo(firstSectorOfCluster(nextCluster)*bytesPerSector);
-        currentCluster = nextCluster;
-        read(imageid, psector, LCD_SSIZE);
-        i = 0;
-      }
+    // first token is command
+    if (command == NULL)
+      command = token;
+    // check for invalid character
+    else if (num_command_args == 0 && strchr(token,'/') != NULL) {
+      fprintf(out, "fat-edit: Invalid character \'/\' detected.\n");
+      command = NULL;
+      return;
     }
+    // other tokens are arguments
+    else if (num_command_args < MAX_ARGS)
+      command_args[num_command_args++] = token;
   }
+}
 
-  // continue if no failures occured
-  if (result == -1) {
-    // check for no more room in current cluster
-    if (freeEntryIndex == -1) {
-      // allocate new cluster
-      nextCluster = newCluster(currentCluster);
-      // check for out of space
-      if (nextCluster == 0) {
-        seekTo(firstSectorOfCluster(originalCluster)*bytesPerSector);
-        currentCluster = originalCluster;
-        read(imageid, psector, LCD_SSIZE);
-        return 3;
-      }
+/** clear_buffer - empties the arena and the parsed command for the next
+                   input
+ **/
+void clear_buffer() {
+  arenaUsed = 0;
+  buffer = NULL;
+  command = NULL;
+  command_args = NULL;
+  num_command_args = 0;
+}
 
-      // go to new cluster
-      seekTo(firstSectorOfCluster(nextCluster)*bytesPerSector);
-      currentCluster = nextCluster;
-      freeEntryIndex = 0;
-    }
-    
-    // write filename
-    seekTo(firstSectorOfCluster(currentCluster)*bytesPerSector + freeEntryIndex*32);
-    write(imageid, filename, 11);
-    // write filesize
-    seekTo(firstSectorOfCluster(currentCluster)*bytesPerSector + (28 + freeEntryIndex*32));
-    memcpy(&filesize_raw, &filesize, 4);
-    write(imageid, filesize_raw, 4);
+/** arenaAlloc - takes len bytes from the thread's arena, returns NULL when
+                 it is full; clear_buffer gives everything back at once
+ **/
+void *arenaAlloc(unsigned int len) {
+  char *block;
 
-    result = 0;
-  }
+  // keep pointers taken from the arena aligned
+  len = (len + sizeof(void*)-1) & ~(unsigned int)(sizeof(void*)-1);
+  if (len > ARENA_BYTES - arenaUsed)
+    return NULL;
+  block = &arena[arenaUsed];
+  arenaUsed += len;
 
-  free(filename);
+  return block;
+}
 
-  seekTo(firstSectorOfCluster(originalCluster)*bytesPerSector);
-  currentCluster = originalCluster;
-  read(imageid, psector, LCD_SSIZE);
+/** execute - looks the command up in the command table and runs it when
+              it has a proper number of arguments
+ **/
+void execute() {
+  const command_entry *entry;
+  command_entry key;
+
+  key.name = command;
+  entry = (const command_entry*)bsearch(&key, commands, sizeof(commands)/sizeof(commands[0]),
+                                        sizeof(command_entry), commandOrder);
+  if (entry == NULL)
+    fprintf(out, "fat-edit: Command not found: %s\n",command);
+  else if (num_command_args < entry->minArgs || num_command_args > entry->maxArgs)
+    usage_error(command);
+  else
+    entry->run();
+}
 
-  return result;
+/** commandOrder - orders command table entries by name for bsearch
+ **/
+int commandOrder(const void *a, const void *b) {
+  return strcmp(((const command_entry*)a)->name, ((const command_entry*)b)->name);
 }
 
-/** fat_read - reads a certain number of bytes of information from the
-               given file starting at the requested location
+/** run_exit - exit
  **/
-int fat_read(char *file_name, unsigned int start_pos, unsigned int num_bytes) {
-  char *filename = (char*)malloc(strlen(file_name)*sizeof(char));
-  char data;
-  int bytesToRead;
-  char entry_filename[12];
-  entry_filename[11] = 0;
-  unsigned short clusHigh, clusLow;
-  char attrLongName;
-  int result, i, j, nextCluster, originalCluster, openFT_index;
-  unsigned int filesize;
-
-  result = -1;
-  strcpy(filename,file_name);
-  convertFilename(filename);
-  originalCluster = currentCluster;
-
-  // navigate through current directory
-  for (i = 0; i < 64 && result == -1; ++i) {
-    memcpy(&entry_filename, &psector[32*i], 11);
-    memcpy(&attrLongName, &psector[11 + 32*i], 1);
-    
-    // no more entries
-    if (entry_filename[0] == 0x00) {
-      result = 1;
-    }
-    // ignore empty entries and long entry names
-    else if (entry_filename[0] != FREE &&
-             attrLongName != LONG_DIRECTORY &&
-             strcmp(entry_filename,filename) == 0) {
-      // file is a directory
-      if (attrLongName == SUB_DIRECTORY)
-	      result = 4;
-      // file found
-      else {
-        // get cluster values
-        memcpy(&clusHigh, &psector[20 + 32*i], 2);
-        memcpy(&clusLow, &psector[26 + 32*i], 2);
-
-        // check if file is open already
-        for (j = 0; j < openFT_count && result == -1; j++)
-          // file is open
-          if (openFT[j].firstCluster == combineShorts(clusHigh,clusLow)) {
-            // check for read permissions
-            if (openFT[j].mode != O_RDONLY &&
-                openFT[j].mode != O_RDWR)
-              result = 3;
-            // file is allowed to read
-            else {
-              openFT_index = j;
-              result = 0;
-            }
-          }
-
-        // file is not open
-        if (result == -1)
-          result = 2;
-        // file is open and allowed to read
-        else if (result == 0) {
-          // get file size
-          memcpy(&filesize, &psector[28 + 32*i], 4);
-
-          // check for start position beyond EoF
-          if (start_pos >= filesize)
-            result = 5;
-          // ready to read
-          else {
-            // find first cluster
-            nextCluster = openFT[openFT_index].firstCluster;
-            // determine if more clusters need to be read until start position
-            while (start_pos >= bytesPerCluster) {
-              nextCluster = getNextCluster(nextCluster);
-              start_pos -= bytesPerCluster;
-              filesize -= bytesPerCluster;
-            }
-
-            // go to data section and begin reading from appropriate start position
-            seekTo(firstSectorOfCluster(nextCluster)*bytesPerSector);
-            currentCluster = nextCluster;
-            read(imageid, psector, LCD_SSIZE);
-            bytesToRead = num_bytes;
-            for (j = 0; j < start_pos+num_bytes && bytesToRead && filesize > 0; j++, filesize--) {
-              if (j >= start_pos) {
-                memcpy(&data, &psector[j], 1);
-                printf("%c",data);
-                bytesToRead--;
-              }
-              // check for end end of cluster before finished reading
-              if (j == LCD_SSIZE-1 && bytesToRead) {
-                nextCluster = getNextCluster(currentCluster);
-                // check for EoF
-                if (nextCluster >= EoC) {
-                  printf("\nfat-edit: read: EoF reached.");
-                  break;
-                }
-                // more valid data, seek to it
-                else {
-                  seekTo(firstSectorOfCluster(nextCluster)*bytesPerSector);
-                  currentCluster = nextCluster;
-                  read(imageid, psector, LCD_SSIZE);
-                  j = -1;
-                  start_pos = 0;
-                  num_bytes -= (num_bytes-bytesToRead);
-                }
-              }
-            }
-            printf("\n");
-            if (filesize == 0)
-              printf("fat-edit: read: EoF reached.\n");
-          }
-        }
-      }
-    }
+void run_exit() {
+  stay_alive = 0;
+}
+
+/** run_fsinfo - fsinfo
+ **/
+void run_fsinfo() {
+  fat_info();
+}
+
+/** run_open - open <file_name> <r|w|rw|a>
+ **/
+void run_open() {
+  int result;
+  char *open_mode;
+
+  result = fat_open(command_args[0],command_args[1]);
+  switch (result) {
+    case 0: if (strcmp(command_args[1],"r") == 0) open_mode = "reading";
+            else if (strcmp(command_args[1],"w") == 0) open_mode = "writing";
+            else if (strcmp(command_args[1],"rw") == 0 ||
+                     strcmp(command_args[1],"wr") == 0) open_mode = "reading and writing";
+            else open_mode = "appending";
+            fprintf(out, "%s has been opened for %s.\n",command_args[0],open_mode);
+            break;
+    case 1: fprintf(out, "fat-edit: open: %s doesn't exist.\n",command_args[0]); break;
+    case 2: fprintf(out, "fat-edit: open: %s is already open.\n",command_args[0]); break;
+    case 3: fprintf(out, "fat-edit: open: %s is not a file.\n",command_args[0]); break;
+    case 4: fprintf(out, "fat-edit: open: Invalid open mode.\n"); break;
+    case 5: fprintf(out, "fat-edit: open: Permission denied - file is read-only.\n"); break;
+    default: break;
+  }
+}
+
+/** run_close - close <file_name>
+ **/
+void run_close() {
+  int result;
+
+  result = fat_close(command_args[0]);
+  switch (result) {
+    case 0: fprintf(out, "%s has been closed.\n",command_args[0]); break;
+    case 1: fprintf(out, "fat-edit: close: %s doesn't exist.\n",command_args[0]); break;
+    case 2: fprintf(out, "fat-edit: close: %s isn't open.\n",command_args[0]); break;
+    case 3: fprintf(out, "fat-edit: close: %s is not a file.\n",command_args[0]); break;
+    default: break;
+  }
+}
+
+/** run_create - create <file_name>
+ **/
+void run_create() {
+  int result;
+
+  result = fat_create(command_args[0]);
+  switch (result) {
+    case 1: fprintf(out, "fat-edit: create: %s already exists.\n",command_args[0]); break;
+    case 2: fprintf(out, "fat-edit: create: %s is a directory.\n",command_args[0]); break;
+    case 3: fprintf(out, "fat-edit: create: FAT32 volume ran out of space.\n"); break;
+    default: break;
+  }
+}
+
+/** run_read - read <file_name> <start_pos> <num_bytes>
+ **/
+void run_read() {
+  int result;
+
+  result = fat_read(command_args[0],strtoul(command_args[1],NULL,10),
+                    strtoul(command_args[2],NULL,10));
+  switch (result) {
+    case 1: fprintf(out, "fat-edit: read: %s doesn't exist.\n",command_args[0]); break;
+    case 2: fprintf(out, "fat-edit: read: %s isn't open.\n",command_args[0]); break;
+    case 3: fprintf(out, "fat-edit: read: %s doesn't have read permission.\n",command_args[0]); break;
+    case 4: fprintf(out, "fat-edit: read: %s is not a file.\n",command_args[0]); break;
+    case 5: fprintf(out, "fat-edit: read: Start position beyond EoF.\n"); break;
+    default: break;
+  }
+}
+
+/** run_write - write <file_name> <start_pos> <"data">
+ **/
+void run_write() {
+  int result;
+  unsigned int start;
+
+  start = strtoul(command_args[1],NULL,10);
+  result = fat_write(command_args[0],&start,command_args[2]);
+  switch (result) {
+    case 0: fprintf(out, "Wrote \"%s\" @ %u of length %d to %s\n",command_args[2],
+                                                            start,
+                                                            (int)strlen(command_args[2]),
+                                                            command_args[0]);
+                                                            break;
+    case 1: fprintf(out, "fat-edit: write: %s doesn't exist.\n",command_args[0]); break;
+    case 2: fprintf(out, "fat-edit: write: %s isn't open.\n",command_args[0]); break;
+    case 3: fprintf(out, "fat-edit: write: %s doesn't have write permission.\n",command_args[0]); break;
+    case 4: fprintf(out, "fat-edit: write: %s is not a file.\n",command_args[0]); break;
+    case 5: fprintf(out, "fat-edit: write: Start position beyond EoF.\n"); break;
+    case 6: fprintf(out, "fat-edit: write: FAT32 volume ran out of space.\n"); break;
+    default: fprintf(out, "fat-edit: write: %s.\n",fatedit_strerror(result)); break;
+  }
+}
+
+/** run_rm - rm <file_name>
+ **/
+void run_rm() {
+  int result;
+
+  result = fat_rm(command_args[0],0);
+  switch (result) {
+    case 1: fprintf(out, "fat-edit: rm: %s doesn't exist.\n",command_args[0]); break;
+    case 2: fprintf(out, "fat-edit: rm: %s is a directory.\n",command_args[0]); break;
+    default: break;
+  }
+}
+
+/** run_srm - srm <file_name>
+ **/
+void run_srm() {
+  int result;
+
+  result = fat_rm(command_args[0],1);
+  switch (result) {
+    case 1: fprintf(out, "fat-edit: srm: %s doesn't exist.\n",command_args[0]); break;
+    case 2: fprintf(out, "fat-edit: srm: %s is a directory.\n",command_args[0]); break;
+    default: break;
+  }
+}
+
+/** run_cd - cd <dir_name>
+ **/
+void run_cd() {
+  int result;
+
+  // check if parent call is in root already
+  if (strcmp(command_args[0],"..") == 0 &&
+           ses->currentCluster == vol->rootCluster)
+    fprintf(out, "fat-edit: cd: Root directory has no parent.\n");
+  else {
+    result = fat_cd(command_args[0]);
+    switch (result) {
+      case 1: fprintf(out, "fat-edit: cd: %s doesn't exist.\n",command_args[0]); break;
+      case 2: fprintf(out, "fat-edit: cd: %s is not a directory.\n",command_args[0]); break;
+      default: break;
+    }
+  }
+}
+
+/** run_ls - ls [-l | -j] <dir_name>
+ **/
+void run_ls() {
+  int result;
+  int ls_format;
+  char *dir_name;
+
+  if (num_command_args == 1)
+    ls_format = LS_NAMES;
+  else if (strcmp(command_args[0],"-l") == 0)
+    ls_format = LS_LONG;
+  else if (strcmp(command_args[0],"-j") == 0)
+    ls_format = LS_JSON;
+  else
+    ls_format = -1;
+  dir_name = command_args[num_command_args-1];
+
+  if (ls_format < 0)
+    usage_error("ls");
+  // check if parent call is in root already
+  else if (strcmp(dir_name,"..") == 0 &&
+           ses->currentCluster == vol->rootCluster)
+    fprintf(out, "fat-edit: ls: Root directory has no parent.\n");
+  else {
+    result = fat_ls(dir_name, ls_format);
+    switch (result) {
+      case 1: fprintf(out, "fat-edit: ls: %s doesn't exist.\n",dir_name); break;
+      case 2: fprintf(out, "fat-edit: ls: %s is not a directory.\n",dir_name); break;
+      default: break;
+    }
+  }
+}
+
+/** run_mkdir - mkdir <dir_name>
+ **/
+void run_mkdir() {
+  int result;
+
+  result = fat_mkdir(command_args[0]);
+  switch (result) {
+    case 1: fprintf(out, "fat-edit: mkdir: %s is already a file.\n",command_args[0]); break;
+    case 2: fprintf(out, "fat-edit: mkdir: %s already exists.\n",command_args[0]); break;
+    case 3: fprintf(out, "fat-edit: mkdir: FAT32 volume ran out of space.\n"); break;
+    default: break;
+  }
+}
+
+/** run_mv - mv <from> <to>
+ **/
+void run_mv() {
+  int result;
+
+  result = fat_mv(command_args[0],command_args[1]);
+  switch (result) {
+    case 1: fprintf(out, "fat-edit: mv: %s doesn't exist.\n",command_args[0]); break;
+    case 2: fprintf(out, "fat-edit: mv: %s already exists.\n",command_args[1]); break;
+    case 3: fprintf(out, "fat-edit: mv: Cannot move %s into itself.\n",command_args[0]); break;
+    case 4: fprintf(out, "fat-edit: mv: %s isn't a directory.\n",command_args[1]); break;
+    case 5: fprintf(out, "fat-edit: mv: Out of space.\n"); break;
+    default: break;
+  }
+}
+
+/** run_cp - cp <from> <to>
+ **/
+void run_cp() {
+  int result;
+
+  result = fat_cp(command_args[0],command_args[1]);
+  switch (result) {
+    case 1: fprintf(out, "fat-edit: cp: %s doesn't exist.\n",command_args[0]); break;
+    case 2: fprintf(out, "fat-edit: cp: %s is a directory.\n",command_args[0]); break;
+    case 3: fprintf(out, "fat-edit: cp: %s already exists.\n",command_args[1]); break;
+    case 4: fprintf(out, "fat-edit: cp: %s isn't a directory.\n",command_args[1]); break;
+    case 5: fprintf(out, "fat-edit: cp: Out of space.\n"); break;
+    case 6: fprintf(out, "fat-edit: cp: Unable to copy %s.\n",command_args[0]); break;
+    default: break;
+  }
+}
+
+/** run_compact - compact <dir_name>
+ **/
+void run_compact() {
+  int result;
+
+  result = fat_compact(command_args[0]);
+  switch (result) {
+    case 1: fprintf(out, "fat-edit: compact: %s doesn't exist.\n",command_args[0]); break;
+    case 2: fprintf(out, "fat-edit: compact: %s is not a directory.\n",command_args[0]); break;
+    default: break;
+  }
+}
+
+/** run_truncate - truncate|fallocate <file_name> <size>
+ **/
+void run_truncate() {
+  int result;
+
+  result = fat_resize(command_args[0],command_args[1],strcmp(command,"truncate") == 0);
+  switch (result) {
+    case 1: fprintf(out, "fat-edit: %s: %s doesn't exist.\n",command,command_args[0]); break;
+    case 2: fprintf(out, "fat-edit: %s: %s is a directory.\n",command,command_args[0]); break;
+    case 3: fprintf(out, "fat-edit: %s: %s is read-only.\n",command,command_args[0]); break;
+    case 4: fprintf(out, "fat-edit: %s: Out of space.\n",command); break;
+    case 5: fprintf(out, "fat-edit: %s: Invalid size %s.\n",command,command_args[1]); break;
+    default: break;
+  }
+}
+
+/** run_rmdir - rmdir <dir_name>
+ **/
+void run_rmdir() {
+  int result;
+
+  if (strcmp(command_args[0],".") == 0)
+    fprintf(out, "fat-edit: rm: Cannot delete current working directory.\n");
+  else if (strcmp(command_args[0],"..") == 0)
+    fprintf(out, "fat-edit: rm: Cannot delete parent directory.\n");
+  else {
+    result = fat_rmdir(command_args[0]);
+    switch (result) {
+      case 1: fprintf(out, "fat-edit: rmdir: %s doesn't exist.\n",command_args[0]); break;
+      case 2: fprintf(out, "fat-edit: rmdir: %s is not a directory.\n",command_args[0]); break;
+      case 3: fprintf(out, "fat-edit: rmdir: %s is not empty.\n",command_args[0]); break;
+      default: break;
+    }
+  }
+}
+
+/** run_find - find|du <dir_name> [-name pattern] [-type f|d] ...
+ **/
+void run_find() {
+  int result;
+
+  result = fat_find(command_args, num_command_args, strcmp(command,"du") == 0);
+  switch (result) {
+    case 1: fprintf(out, "fat-edit: %s: %s doesn't exist.\n",command,command_args[0]); break;
+    case 2: fprintf(out, "fat-edit: %s: %s is not a directory.\n",command,command_args[0]); break;
+    case 3: usage_error(command); break;
+    default: break;
+  }
+}
+
+/** run_size - size <file_name>
+ **/
+void run_size() {
+  int result;
+
+  result = fat_size(command_args[0]);
+  switch (result) {
+    case 1: fprintf(out, "fat-edit: size: %s doesn't exist.\n",command_args[0]); break;
+    case 2: fprintf(out, "fat-edit: size: %s is not a file.\n",command_args[0]); break;
+    default: break;
+  }
+}
+
+/** run_sync - sync
+ **/
+void run_sync() {
+  if (fatedit_sync(ses) != FATEDIT_OK)
+    fprintf(out, "fat-edit: sync: Unable to write %s.\n",vol->imagename);
+}
+
+/** run_recount - recount
+ **/
+void run_recount() {
+  int result;
+
+  result = fatedit_recount(ses);
+  if (result < 0)
+    fprintf(out, "fat-edit: recount: %s.\n",fatedit_strerror(result));
+  else
+    fprintf(out, "Number of free clusters: %d\n",result);
+}
+
+/** run_commit - commit
+ **/
+void run_commit() {
+  int result, records;
+
+  if (vol->overlayid < 0)
+    fprintf(out, "fat-edit: commit: No overlay is active.\n");
+  else {
+    enterSession(ses, 1);
+    records = vol->overlayRecords;
+    result = overlayCommit();
+    if (result == 0)
+      result = overlayDiscard() || overlayClose();
+    leaveSession(ses);
+    if (result != 0)
+      fprintf(out, "fat-edit: commit: Unable to write %s.\n",vol->imagename);
+    else {
+      fprintf(out, "Committed %d sectors to %s.\n", records, vol->imagename);
+      stay_alive = 0;
+    }
+  }
+}
+
+/** run_discard - discard
+ **/
+void run_discard() {
+  int result;
+
+  if (vol->overlayid < 0)
+    fprintf(out, "fat-edit: discard: No overlay is active.\n");
+  else {
+    enterSession(ses, 1);
+    result = overlayDiscard() || overlayClose();
+    leaveSession(ses);
+    if (result != 0)
+      fprintf(out, "fat-edit: discard: Unable to remove %s.\n",vol->overlayname);
+    else
+      fprintf(out, "Discarded all changes to %s.\n",vol->imagename);
+    stay_alive = 0;
+  }
+}
+
+/** usage_error - prints out an error upon improper argument usage
+                  for a given command
+ **/
+void usage_error(char *cmd) {
+  fprintf(out, "fat-edit: %s: Improper argument usage.\n",cmd);
+}
+
+/** usage - prints out the proper command line syntax
+ **/
+void usage() {
+  fprintf(out, "Bad argument syntax.\n");
+  fprintf(out, "Usage: fat-edit [-u] [-C cache_sectors] [-r read_ahead_clusters]\n");
+  fprintf(out, "                [-j walk_threads] [-B dirty_sectors] [-Y fsync|fdatasync]\n");
+  fprintf(out, "                [-K free_slots] [-o overlay_delta] [-p partition] <fs_image.img>\n");
+  fprintf(out, "       fat-edit [-u] [-C cache_sectors] [-r read_ahead_clusters] [-B dirty_sectors]\n");
+  fprintf(out, "                [-Y fsync|fdatasync] [-K free_slots] -D <socket>\n");
+  fprintf(out, "       fat-edit -R <socket> [-p partition] <fs_image.img>\n");
+  fprintf(out, "       fat-edit [-u] -m [-S size_MB] [-s bytes_per_sector] [-c sectors_per_cluster]\n");
+  fprintf(out, "                   [-f num_FATs] [-t seed [-d depth] [-w subdirs] [-n files]]\n");
+  fprintf(out, "                   <fs_image.img>\n");
+}
+
+/** fat_info - prints out important information relating to the FAT32 volume
+ **/
+void fat_info() {
+  if (vol->base != 0)
+    fprintf(out, "Partition offset: %lld bytes\n", (long long)vol->base);
+  fprintf(out, "Bytes per sector: %hd\n", vol->bytesPerSector);
+  fprintf(out, "Sectors per cluster: %d\n", vol->sectorsPerCluster);
+  fprintf(out, "Total number of sectors: %u\n", vol->numTotalSectors);
+  fprintf(out, "Number of free sectors: %llu\n",
+          (unsigned long long)vol->freeClusters*vol->sectorsPerCluster);
+  fprintf(out, "Number of free clusters: %u\n", vol->freeClusters);
+  fprintf(out, "Next free cluster: %u\n", vol->nextFreeLocation);
+  fprintf(out, "Number of FATs: %d\n", vol->numFATs);
+  fprintf(out, "Sectors per FAT: %u\n", vol->sizeFAT);
+}
+
+/** fat_open - open a file with the given mode
+ **/
+int fat_open(char *file_name, char *mode) {
+  fatedit_info st;
+  int flags, error;
+
+  // invalid mode
+  if (strcmp(mode,"r") == 0)
+    flags = O_RDONLY;
+  else if (strcmp(mode,"w") == 0)
+    flags = O_WRONLY;
+  else if (strcmp(mode,"rw") == 0 || strcmp(mode,"wr") == 0)
+    flags = O_RDWR;
+  else if (strcmp(mode,"a") == 0)
+    flags = O_WRONLY | O_APPEND;
+  else
+    return 4;
+
+  if (fatedit_stat(ses, file_name, &st) != FATEDIT_OK)
+    return 1;
+  // file is a directory
+  if (st.attr & SUB_DIRECTORY)
+    return 3;
+  if ((st.attr & READ_ONLY) && flags != O_RDONLY)
+    return 5;
+  // check if file is open already
+  if (findOpenFile(st.id) != NULL)
+    return 2;
+
+  if (fatedit_file_open(ses, file_name, flags, &error) == NULL)
+    return error == FATEDIT_EACCES ? 5 : 1;
+
+  return 0;
+}
+
+/** fat_close - closes an open file
+ **/
+int fat_close(char *file_name) {
+  fatedit_info st;
+  fatedit_file *file;
+
+  if (fatedit_stat(ses, file_name, &st) != FATEDIT_OK)
+    return 1;
+  // file is a directory
+  if (st.attr & SUB_DIRECTORY)
+    return 3;
+  // check if file is open
+  file = findOpenFile(st.id);
+  if (file == NULL)
+    return 2;
+
+  fatedit_file_close(file);
+  return 0;
+}
+
+/** fat_create - creats a new empty file in the current directory tree
+ **/
+int fat_create(char *file_name) {
+  fatedit_info st;
+  fatedit_file *file;
+  int error;
+
+  // file or directory exists already
+  if (fatedit_stat(ses, file_name, &st) == FATEDIT_OK)
+    return (st.attr & SUB_DIRECTORY) ? 2 : 1;
+
+  file = fatedit_file_open(ses, file_name, O_WRONLY | O_CREAT | O_EXCL, &error);
+  if (file == NULL)
+    return 3;
+  fatedit_file_close(file);
+
+  return 0;
+}
+
+/** fat_read - reads a certain number of bytes of information from the
+               given file starting at the requested location
+ **/
+int fat_read(char *file_name, unsigned int start_pos, unsigned int num_bytes) {
+  fatedit_info st;
+  fatedit_file *file;
+  char data[READ_BUFFER];
+  unsigned int done;
+  ssize_t got;
+
+  if (fatedit_stat(ses, file_name, &st) != FATEDIT_OK)
+    return 1;
+  // file is a directory
+  if (st.attr & SUB_DIRECTORY)
+    return 4;
+  // file is not open
+  file = findOpenFile(st.id);
+  if (file == NULL)
+    return 2;
+  // check for read permissions
+  if (file->mode == O_WRONLY)
+    return 3;
+  // check for start position beyond EoF
+  if (start_pos >= st.size)
+    return 5;
+
+  // read no further than the end of the file, a buffer at a time
+  if (num_bytes > st.size - start_pos)
+    num_bytes = st.size - start_pos;
+  for (done = 0, got = 0; done < num_bytes; done += got) {
+    got = fatedit_pread(file, data, num_bytes - done < READ_BUFFER ?
+                                    num_bytes - done : READ_BUFFER, start_pos + done);
+    if (got <= 0)
+      break;
+    fwrite(data, 1, got, out);
+  }
+
+  fprintf(out, "\n");
+  if (got < 0 || start_pos + done >= st.size)
+    fprintf(out, "fat-edit: read: EoF reached.\n");
+
+  return 0;
+}
+
+/** fat_write - writes a certain number of bytes of information to the
+                given file starting at the requested location, or at its
+                end when it is open for appending
+ **/
+int fat_write(char *file_name, unsigned int *start_pos, char *quoted_data) {
+  fatedit_info st;
+  fatedit_file *file;
+  ssize_t written;
+
+  if (fatedit_stat(ses, file_name, &st) != FATEDIT_OK)
+    return 1;
+  // file is a directory
+  if (st.attr & SUB_DIRECTORY)
+    return 4;
+  // file is not open
+  file = findOpenFile(st.id);
+  if (file == NULL)
+    return 2;
+  // check for write permissions
+  if (file->mode == O_RDONLY)
+    return 3;
+
+  if (file->append)
+    *start_pos = st.size;
+  written = fatedit_pwrite(file, quoted_data, strlen(quoted_data), *start_pos);
+
+  // anything without a message of its own is reported as is
+  switch (written < 0 ? (int)written : FATEDIT_OK) {
+    case FATEDIT_OK: return 0;
+    case FATEDIT_ENOENT: return 1;
+    case FATEDIT_EACCES: return 3;
+    case FATEDIT_EISDIR: return 4;
+    case FATEDIT_ENOSPC: return 6;
+    default: return (int)written;
+  }
+}
+
+/** fat_rm - deletes a file in the current directory
+ **/
+int fat_rm(char *file_name, int clear) {
+  fatedit_info st;
+
+  if (fatedit_stat(ses, file_name, &st) != FATEDIT_OK)
+    return 1;
+  // file is a directory
+  if (st.attr & SUB_DIRECTORY)
+    return 2;
+
+  fatedit_unlink(ses, file_name, clear ? FATEDIT_ERASE : 0);
+  return 0;
+}
+
+/** fat_cd - changes the current working directory to the specified one
+ **/
+int fat_cd(char *dir_name) {
+  switch (fatedit_chdir(ses, dir_name)) {
+    case FATEDIT_OK: return 0;
+    case FATEDIT_ENOTDIR: return 2;
+    default: return 1;
+  }
+}
+
+/** fat_ls - lists the entries of a directory, as names only, one
+             `ls -l` style line per entry or a JSON array, all from one
+             pass over the directory
+ **/
+int fat_ls(char *dir_name, int format) {
+  fatedit_info st, entries[64];
+  long long cookie;
+  char attrs[6], created[20], modified[20];
+  int count, i, first;
+
+  if (fatedit_stat(ses, dir_name, &st) != FATEDIT_OK)
+    return 1;
+  // entry is a file
+  if (!(st.attr & SUB_DIRECTORY))
+    return 2;
+
+  // print out entries a batch at a time
+  cookie = 0;
+  first = 1;
+  if (format == LS_JSON)
+    fprintf(out, "[");
+  while ((count = fatedit_readdir(ses, dir_name, entries, 64, &cookie)) > 0) {
+    for (i = 0; i < count; i++, first = 0) {
+      if (format == LS_NAMES) {
+        removeTailWhitespace(entries[i].shortname);
+        fprintf(out, "%s   ", entries[i].shortname);
+        continue;
+      }
+
+      formatTimestamp(entries[i].created, created);
+      formatTimestamp(entries[i].modified, modified);
+      if (format == LS_LONG) {
+        formatAttributes(entries[i].attr, attrs);
+        fprintf(out, "%s %10u %8u  %s  %s  %s\n", attrs, entries[i].size,
+                entries[i].firstCluster, created, modified, entries[i].name);
+      }
+      else {
+        // short names never need escaping, the characters FAT allows in
+        // them are all plain in JSON
+        fprintf(out, "%s\n  {\"name\": \"%s\", \"directory\": %s, \"attr\": %d, "
+                "\"size\": %u, \"cluster\": %u, ", first ? "" : ",", entries[i].name,
+                (entries[i].attr & SUB_DIRECTORY) ? "true" : "false",
+                (unsigned char)entries[i].attr, entries[i].size, entries[i].firstCluster);
+        if (entries[i].created != 0)
+          fprintf(out, "\"created\": \"%s\", ", created);
+        else
+          fprintf(out, "\"created\": null, ");
+        if (entries[i].modified != 0)
+          fprintf(out, "\"modified\": \"%s\"}", modified);
+        else
+          fprintf(out, "\"modified\": null}");
+      }
+    }
+  }
+  if (format == LS_NAMES)
+    fprintf(out, "\n");
+  else if (format == LS_JSON)
+    fprintf(out, "%s]\n", first ? "" : "\n");
+
+  return 0;
+}
+
+/** formatAttributes - spells out attribute bits as "drhsa" with dashes
+ **/
+void formatAttributes(unsigned char attr, char *attrs) {
+  attrs[0] = (attr & SUB_DIRECTORY) ? 'd' : '-';
+  attrs[1] = (attr & READ_ONLY) ? 'r' : '-';
+  attrs[2] = (attr & HIDDEN) ? 'h' : '-';
+  attrs[3] = (attr & SYSTEM) ? 's' : '-';
+  attrs[4] = (attr & ARCHIVE) ? 'a' : '-';
+  attrs[5] = 0;
+}
+
+/** formatTimestamp - prints seconds since the epoch as local
+                      YYYY-MM-DD HH:MM:SS, or dashes when unset
+ **/
+void formatTimestamp(long long seconds, char *text) {
+  struct tm tm;
+  time_t t;
+
+  t = seconds;
+  if (seconds == 0 || localtime_r(&t, &tm) == NULL)
+    strcpy(text, "---------- --:--:--");
+  else
+    strftime(text, 20, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
+/** fat_find - lists or totals the entries below a directory, filtered by
+               -name <pattern>, -type f|d and -size [+|-]<bytes>
+ **/
+int fat_find(char **args, int num_args, int du) {
+  fatedit_info st;
+  find_query query;
+  int i, result;
+
+  memset(&query, 0, sizeof(query));
+  query.du = du;
+  query.out = out;
+  for (i = 1; i < num_args; i += 2) {
+    if (i+1 == num_args)
+      return 3;
+    if (strcmp(args[i],"-name") == 0)
+      query.name = args[i+1];
+    else if (strcmp(args[i],"-type") == 0 &&
+             (strcmp(args[i+1],"f") == 0 || strcmp(args[i+1],"d") == 0))
+      query.type = args[i+1][0];
+    else if (strcmp(args[i],"-size") == 0 && args[i+1][0] != 0) {
+      query.sizeOp = args[i+1][0] == '+' || args[i+1][0] == '-' ? args[i+1][0] : '=';
+      query.size = strtoul(args[i+1] + (query.sizeOp != '='), NULL, 10);
+    }
+    else
+      return 3;
+  }
+
+  if (fatedit_stat(ses, args[0], &st) != FATEDIT_OK)
+    return 1;
+  // entry is a file
+  if (!(st.attr & SUB_DIRECTORY))
+    return 2;
+
+  query.bytesPerCluster = vol->bytesPerCluster;
+  pthread_mutex_init(&query.lock, NULL);
+  result = fatedit_walk(ses, args[0], walkThreads, findVisit, &query);
+  pthread_mutex_destroy(&query.lock);
+  if (result != FATEDIT_OK)
+    return 1;
+
+  if (du)
+    fprintf(out, "%llu bytes in %llu files, %llu directories (%llu bytes allocated)\n",
+            query.bytes, query.files, query.dirs, query.allocated);
+
+  return 0;
+}
+
+/** findVisit - prints or counts one entry of a find or du walk if it
+                passes the filters
+ **/
+int findVisit(const char *path, const fatedit_info *info, void *arg) {
+  find_query *query;
+  int dir;
+
+  query = (find_query*)arg;
+  dir = (info->attr & SUB_DIRECTORY) != 0;
+  if ((query->type == 'f' && dir) || (query->type == 'd' && !dir))
+    return 0;
+  if ((query->sizeOp == '+' && info->size <= query->size) ||
+      (query->sizeOp == '-' && info->size >= query->size) ||
+      (query->sizeOp == '=' && info->size != query->size))
+    return 0;
+  if (query->name != NULL && fnmatch(query->name, info->name, FNM_CASEFOLD) != 0)
+    return 0;
+
+  // results stream out as workers find them
+  if (!query->du) {
+    fprintf(query->out, "%s\n", path);
+    return 0;
+  }
+
+  pthread_mutex_lock(&query->lock);
+  if (dir)
+    query->dirs++;
+  else {
+    query->files++;
+    query->bytes += info->size;
+    query->allocated += (info->size + query->bytesPerCluster-1) /
+                        query->bytesPerCluster * query->bytesPerCluster;
+  }
+  pthread_mutex_unlock(&query->lock);
+
+  return 0;
+}
+
+/** fat_mkdir - creates a new directory in the current directory
+ **/
+int fat_mkdir(char *dir_name) {
+  fatedit_info st;
+
+  // file or directory exists already
+  if (fatedit_stat(ses, dir_name, &st) == FATEDIT_OK)
+    return (st.attr & SUB_DIRECTORY) ? 2 : 1;
+
+  if (fatedit_mkdir(ses, dir_name) != FATEDIT_OK)
+    return 3;
+
+  return 0;
+}
+
+/** fat_rmdir - removes the given directory from the current directory
+ **/
+int fat_rmdir(char *dir_name) {
+  switch (fatedit_rmdir(ses, dir_name)) {
+    case FATEDIT_OK: return 0;
+    case FATEDIT_ENOTDIR: return 2;
+    case FATEDIT_ENOTEMPTY: return 3;
+    default: return 1;
+  }
+}
+
+/** fat_mv - renames an entry or moves it into another directory, into
+             to itself when to is an existing directory
+ **/
+int fat_mv(char *from, char *to) {
+  fatedit_info st;
+  char *target;
+  int result;
+
+  if (fatedit_stat(ses, from, &st) != FATEDIT_OK)
+    return 1;
+
+  target = to;
+  if (fatedit_stat(ses, to, &st) == FATEDIT_OK && (st.attr & SUB_DIRECTORY)) {
+    target = (char*)arenaAlloc(strlen(to) + strlen(from) + 2);
+    sprintf(target, "%s/%s", to, from);
+  }
+  result = fatedit_rename(ses, from, target);
+
+  switch (result) {
+    case FATEDIT_OK: return 0;
+    case FATEDIT_EEXIST: case FATEDIT_EISDIR: return 2;
+    case FATEDIT_EINVAL: return 3;
+    case FATEDIT_ENOTDIR: return 4;
+    case FATEDIT_ENOSPC: return 5;
+    default: return 1;
+  }
+}
+
+/** fat_cp - copies a file inside the image, into to when it is an
+             existing directory
+ **/
+int fat_cp(char *from, char *to) {
+  fatedit_info st;
+  char *target;
+  int result;
+
+  if (fatedit_stat(ses, from, &st) != FATEDIT_OK)
+    return 1;
+  if (st.attr & SUB_DIRECTORY)
+    return 2;
+
+  target = to;
+  if (fatedit_stat(ses, to, &st) == FATEDIT_OK && (st.attr & SUB_DIRECTORY)) {
+    target = (char*)arenaAlloc(strlen(to) + strlen(from) + 2);
+    sprintf(target, "%s/%s", to, from);
+  }
+  result = fatedit_copy(ses, from, target);
+
+  switch (result) {
+    case FATEDIT_OK: return 0;
+    case FATEDIT_EEXIST: case FATEDIT_EINVAL: return 3;
+    case FATEDIT_ENOTDIR: return 4;
+    case FATEDIT_ENOSPC: return 5;
+    case FATEDIT_EIO: return 6;
+    default: return 1;
+  }
+}
+
+/** fat_compact - packs the entries of a directory to its front and
+                  prints out how many slots and clusters it gave back
+ **/
+int fat_compact(char *dir_name) {
+  unsigned int released;
+  int result;
+
+  result = fatedit_compact(ses, dir_name, &released);
+  switch (result) {
+    case FATEDIT_ENOENT: return 1;
+    case FATEDIT_ENOTDIR: return 2;
+    default: break;
+  }
+
+  fprintf(out, "Compacted %s: %d free slots removed, %u clusters released.\n",
+          dir_name, result, released);
+  return 0;
+}
+
+/** fat_resize - sets a file's size with truncate, or only grows it with
+                 fallocate, through a handle of its own
+ **/
+int fat_resize(char *file_name, char *size, int shrink) {
+  fatedit_file *file;
+  unsigned long long bytes;
+  char *end;
+  int result;
+
+  bytes = strtoull(size, &end, 10);
+  if (*size == 0 || *end != 0 || bytes > 0xFFFFFFFFULL)
+    return 5;
+
+  file = fatedit_file_open(ses, file_name, O_WRONLY, &result);
+  if (file != NULL) {
+    result = shrink ? fatedit_ftruncate(file, bytes) : fatedit_fallocate(file, bytes);
+    fatedit_file_close(file);
+  }
+
+  switch (result) {
+    case FATEDIT_OK: return 0;
+    case FATEDIT_EISDIR: return 2;
+    case FATEDIT_EACCES: return 3;
+    case FATEDIT_ENOSPC: return 4;
+    case FATEDIT_EINVAL: return 5;
+    default: return 1;
+  }
+}
+
+/** fat_size - prints out the size of a file in bytes
+ **/
+int fat_size(char *file_name) {
+  fatedit_info st;
+
+  if (fatedit_stat(ses, file_name, &st) != FATEDIT_OK)
+    return 1;
+  // file is a directory
+  if (st.attr & SUB_DIRECTORY)
+    return 2;
+
+  fprintf(out, "%u\n", st.size);
+  return 0;
+}
+
+/** fat_mkfs - formats the given host file as an empty FAT32 volume and
+               optionally fills it with a deterministic synthetic tree
+ **/
+int fat_mkfs(char *file) {
+  char bootsector[4096], info[4096];
+  io_request reqs[4+4];
+  unsigned int bytesPerClus, clusters, fatSectors, prevFatSectors, freeCount, nextFree;
+  unsigned int value, volumeID;
+  unsigned short short_value;
+  off_t imageSize, FATLoc;
+  int j, result;
+
+  // validate geometry
+  if (mkfsOpts.bytesPerSector != 512 && mkfsOpts.bytesPerSector != 1024 &&
+      mkfsOpts.bytesPerSector != 2048 && mkfsOpts.bytesPerSector != 4096) {
+    fprintf(out, "fat-edit: mkfs: Bytes per sector must be 512, 1024, 2048 or 4096.\n");
+    return 1;
+  }
+  bytesPerClus = mkfsOpts.sectorsPerCluster*mkfsOpts.bytesPerSector;
+  if (mkfsOpts.sectorsPerCluster == 0 ||
+      (mkfsOpts.sectorsPerCluster & (mkfsOpts.sectorsPerCluster-1)) != 0 ||
+      bytesPerClus > 32768) {
+    fprintf(out, "fat-edit: mkfs: Sectors per cluster must be a power of two "
+           "of at most 32 KiB per cluster.\n");
+    return 1;
+  }
+  if (mkfsOpts.numFATs < 1 || mkfsOpts.numFATs > 4) {
+    fprintf(out, "fat-edit: mkfs: Number of FATs must be between 1 and 4.\n");
+    return 1;
+  }
+  imageSize = (off_t)mkfsOpts.sizeMB * 1024 * 1024;
+  if (imageSize / mkfsOpts.bytesPerSector > 0xFFFFFFFF ||
+      imageSize / mkfsOpts.bytesPerSector <= MKFS_RESERVED_SECTORS + mkfsOpts.numFATs +
+                                              2*mkfsOpts.sectorsPerCluster) {
+    fprintf(out, "fat-edit: mkfs: Invalid volume size.\n");
+    return 1;
+  }
+
+  // set up volume geometry
+  vol = (volume*)calloc(1, sizeof(volume));
+  vol->overlayid = -1;
+  vol->bytesPerSector = mkfsOpts.bytesPerSector;
+  vol->sectorsPerCluster = mkfsOpts.sectorsPerCluster;
+  vol->numFATs = mkfsOpts.numFATs;
+  vol->reservedSectorCount = MKFS_RESERVED_SECTORS;
+  vol->numTotalSectors = imageSize / vol->bytesPerSector;
+  vol->bytesPerCluster = bytesPerClus;
+  vol->sectorShift = shiftOf(vol->bytesPerSector);
+  vol->clusterShift = shiftOf(vol->bytesPerCluster);
+  vol->rootCluster = 2;
+  vol->fsinfo = 1;
+
+  // size the FAT until it covers every cluster left over after it
+  fatSectors = 1;
+  do {
+    prevFatSectors = fatSectors;
+    clusters = ((unsigned int)vol->numTotalSectors - vol->reservedSectorCount -
+                vol->numFATs*prevFatSectors) / vol->sectorsPerCluster;
+    fatSectors = ((clusters+2)*4 + vol->bytesPerSector-1) / vol->bytesPerSector;
+  } while (fatSectors > prevFatSectors);
+  vol->sizeFAT = prevFatSectors;
+  vol->firstDataSector = vol->reservedSectorCount + vol->numFATs*vol->sizeFAT;
+  clusters = ((unsigned int)vol->numTotalSectors - vol->firstDataSector) / vol->sectorsPerCluster;
+  if (clusters < MKFS_MIN_CLUSTERS)
+    fprintf(out, "fat-edit: mkfs: Warning - %u clusters is below the FAT32 minimum "
+           "of %d.\n", clusters, MKFS_MIN_CLUSTERS);
+
+  // create a sparse, zero filled image
+  vol->imageid = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (vol->imageid < 0 || ftruncate(vol->imageid, imageSize) != 0) {
+    fprintf(out, "fat-edit: mkfs: Unable to create %s.\n", file);
+    if (vol->imageid >= 0)
+      close(vol->imageid);
+    free(vol);
+    vol = NULL;
+    return 1;
+  }
+
+  // reserve FAT entries 0 and 1 and the root directory cluster
+  mkfsClusterCount = clusters;
+  mkfsNextCluster = 3;
+  mkfsFAT = (unsigned int*)malloc(mkfsNextCluster*sizeof(unsigned int));
+  mkfsFAT[0] = 0x0FFFFFF8;
+  mkfsFAT[1] = 0x0FFFFFFF;
+  mkfsFAT[2] = 0x0FFFFFFF;
+
+  // populate synthetic tree
+  result = 0;
+  if (mkfsOpts.populate) {
+    mkfsState = mkfsOpts.seed ? mkfsOpts.seed : 1;
+    if (mkfsPopulate(vol->rootCluster, 0, mkfsOpts.depth) != 0) {
+      fprintf(out, "fat-edit: mkfs: FAT32 volume ran out of space.\n");
+      result = 1;
+    }
+  }
+
+  // build boot sector
+  memset(bootsector, 0, sizeof(bootsector));
+  memcpy(&bootsector[0], "\xEB\x58\x90", 3);
+  memcpy(&bootsector[3], "FATEDIT ", 8);
+  memcpy(&bootsector[11], &vol->bytesPerSector, 2);
+  memcpy(&bootsector[13], &vol->sectorsPerCluster, 1);
+  memcpy(&bootsector[14], &vol->reservedSectorCount, 2);
+  memcpy(&bootsector[16], &vol->numFATs, 1);
+  bootsector[21] = 0xF8;
+  short_value = 32;
+  memcpy(&bootsector[24], &short_value, 2);
+  short_value = 64;
+  memcpy(&bootsector[26], &short_value, 2);
+  memcpy(&bootsector[32], &vol->numTotalSectors, 4);
+  memcpy(&bootsector[36], &vol->sizeFAT, 4);
+  memcpy(&bootsector[44], &vol->rootCluster, 4);
+  memcpy(&bootsector[48], &vol->fsinfo, 2);
+  short_value = MKFS_BACKUP_BOOT;
+  memcpy(&bootsector[50], &short_value, 2);
+  bootsector[64] = 0x80;
+  bootsector[66] = 0x29;
+  volumeID = mkfsOpts.seed * 2654435761u;
+  memcpy(&bootsector[67], &volumeID, 4);
+  memcpy(&bootsector[71], "NO NAME    ", 11);
+  memcpy(&bootsector[82], "FAT32   ", 8);
+  bootsector[510] = 0x55;
+  bootsector[511] = 0xAA;
+
+  // build FSInfo sector
+  freeCount = clusters - (mkfsNextCluster-2);
+  nextFree = mkfsNextCluster;
+  memset(info, 0, sizeof(info));
+  value = FSINFO_LEAD_SIG;
+  memcpy(&info[0], &value, 4);
+  value = FSINFO_STRUC_SIG;
+  memcpy(&info[484], &value, 4);
+  memcpy(&info[488], &freeCount, 4);
+  memcpy(&info[492], &nextFree, 4);
+  value = FSINFO_TRAIL_SIG;
+  memcpy(&info[508], &value, 4);
+
+  // write every FAT copy plus primary and backup boot and FSInfo sectors
+  FATLoc = (off_t)vol->reservedSectorCount*vol->bytesPerSector;
+  for (j = 0; j < vol->numFATs; j++) {
+    reqs[j].write = 1;
+    reqs[j].buf = (char*)mkfsFAT;
+    reqs[j].len = mkfsNextCluster*4;
+    reqs[j].offset = FATLoc + (off_t)j*vol->sizeFAT*vol->bytesPerSector;
+  }
+  for (j = 0; j < 4; j++) {
+    reqs[vol->numFATs+j].write = 1;
+    reqs[vol->numFATs+j].buf = j % 2 == 0 ? bootsector : info;
+    reqs[vol->numFATs+j].len = vol->bytesPerSector;
+    reqs[vol->numFATs+j].offset = (off_t)((j < 2 ? 0 : MKFS_BACKUP_BOOT) +
+                                     (j % 2 == 0 ? 0 : vol->fsinfo))*vol->bytesPerSector;
+  }
+  if (ioBatch(reqs, vol->numFATs+4) != 0) {
+    fprintf(out, "fat-edit: mkfs: Unable to write %s.\n", file);
+    result = 1;
+  }
+
+  free(mkfsFAT);
+  mkfsFAT = NULL;
+  close(vol->imageid);
+
+  if (result == 0) {
+    vol->freeClusters = freeCount;
+    vol->nextFreeLocation = nextFree;
+    fprintf(out, "Formatted %s as FAT32\n", file);
+    fat_info();
+    fprintf(out, "Number of clusters: %u\n", clusters);
+  }
+  free(vol);
+  vol = NULL;
+
+  return result;
+}
+
+/** firstSectorOfCluster - returns the first sector number of
+                           the given cluster index
+ **/
+unsigned int firstSectorOfCluster(unsigned int n) {
+  return ((n-2) * vol->sectorsPerCluster) + vol->firstDataSector;
+}
+
+/** getNextCluster - returns the FAT value for the next cluster
+                     based on the current cluster
+ **/
+unsigned int getNextCluster(unsigned int entryIndex) {
+  unsigned int FATValue;
+  off_t FATLoc;
+
+  // set FAT location
+  FATLoc = (off_t)vol->reservedSectorCount*vol->bytesPerSector;
+
+  // read information
+  readImage(FATLoc + (off_t)entryIndex*4, &FATValue, 4);
+
+  return FATValue;
+}
+
+/** setFATEntry - sets the FAT value of a cluster in every FAT copy
+ **/
+void setFATEntry(unsigned int cluster, unsigned int value) {
+  unsigned int oldValue;
+  off_t FATLoc;
+  int j;
+
+  // set FAT location
+  FATLoc = (off_t)vol->reservedSectorCount*vol->bytesPerSector;
+
+  // keep the free cluster count current
+  oldValue = getNextCluster(cluster) & 0x0FFFFFFF;
+  if (oldValue == EMPTY && (value & 0x0FFFFFFF) != EMPTY)
+    vol->freeClusters--;
+  else if (oldValue != EMPTY && (value & 0x0FFFFFFF) == EMPTY)
+    vol->freeClusters++;
+  vol->fsInfoDirty = 1;
+
+  // update all FAT tables
+  for (j = 0; j < vol->numFATs; j++)
+    writeImage(FATLoc + (off_t)j*vol->sizeFAT*vol->bytesPerSector + (off_t)cluster*4, &value, 4);
+}
+
+/** findFreeCluster - returns the first free cluster at or after the
+                      allocation hint, wrapping around once, or 0 when the
+                      volume is full
+ **/
+unsigned int findFreeCluster() {
+  unsigned int entries[MAX_SSIZE/4];
+  unsigned int cluster, start, end, perSector, i;
+  off_t FATLoc;
+
+  FATLoc = (off_t)vol->reservedSectorCount*vol->bytesPerSector;
+  perSector = vol->bytesPerSector/4;
+  start = vol->nextFreeLocation;
+  if (start < 2 || start >= vol->numClusters+2)
+    start = 2;
+
+  // scan a whole FAT sector per read, from the hint to the end then from
+  // the first cluster up to the hint
+  cluster = start;
+  end = vol->numClusters+2;
+  while (cluster < end) {
+    i = cluster % perSector;
+    readImage(FATLoc + (off_t)(cluster - i)*4, entries, vol->bytesPerSector);
+    for (; i < perSector && cluster < end; i++, cluster++)
+      if ((entries[i] & 0x0FFFFFFF) == EMPTY)
+        return cluster;
+
+    if (cluster == vol->numClusters+2 && start != 2) {
+      cluster = 2;
+      end = start;
+    }
+  }
+
+  return 0;
+}
+
+/** findFreeRun - returns the first cluster of a run of count free
+                  clusters, searching from the allocation hint and then
+                  from the start of the FAT, or 0 when there is no such run
+ **/
+unsigned int findFreeRun(unsigned int count) {
+  io_request req;
+  unsigned int *entries, cluster, start, end, chunk, runStart, runLength, i, pass;
+  off_t FATLoc;
+
+  entries = (unsigned int*)malloc(FAT_SCAN_BYTES);
+  FATLoc = (off_t)vol->reservedSectorCount*vol->bytesPerSector;
+  start = vol->nextFreeLocation;
+  if (start < 2 || start >= vol->numClusters+2)
+    start = 2;
+
+  // the second pass may run past the hint, a run can straddle it
+  runStart = 0;
+  for (pass = 0; pass < 2; pass++) {
+    cluster = pass == 0 ? start : 2;
+    end = pass == 0 || (unsigned long long)start + count > vol->numClusters+2 ?
+          vol->numClusters+2 : start + count;
+    for (runLength = 0; cluster < end; cluster += chunk) {
+      chunk = end - cluster;
+      if (chunk > FAT_SCAN_BYTES/4)
+        chunk = FAT_SCAN_BYTES/4;
+      req.write = 0;
+      req.buf = (char*)entries;
+      req.len = chunk*4;
+      req.offset = FATLoc + (off_t)cluster*4;
+      if (ioBatch(&req, 1) != 0)
+        break;
+
+      for (i = 0; i < chunk; i++) {
+        if ((entries[i] & 0x0FFFFFFF) != EMPTY)
+          runLength = 0;
+        else if (runLength++ == 0)
+          runStart = cluster + i;
+        if (runLength == count) {
+          free(entries);
+          return runStart;
+        }
+      }
+    }
+  }
+  free(entries);
+
+  return 0;
+}
+
+/** readAhead - advises the kernel that up to count clusters of the chain
+                starting at cluster are about to be read, so cold reads
+                overlap with output; returns the number of clusters advised
+                and leaves the last of them in last
+ **/
+int readAhead(unsigned int cluster, int count, unsigned int *last) {
+  unsigned int runStart, runLength;
+  int advised;
+
+  if (count > readAheadClusters)
+    count = readAheadClusters;
+
+  runStart = cluster;
+  runLength = 0;
+  for (advised = 0; advised < count && cluster >= 2 && cluster < EoC; advised++) {
+    // issue one request per contiguous run of clusters
+    if (runLength != 0 && cluster != runStart + runLength) {
+      posix_fadvise(vol->imageid, vol->base + clusterOffset(runStart),
+                    (off_t)runLength*vol->bytesPerCluster, POSIX_FADV_WILLNEED);
+      runStart = cluster;
+      runLength = 0;
+    }
+    runLength++;
+    *last = cluster;
+    cluster = getNextCluster(cluster) & 0x0FFFFFFF;
+  }
+  if (runLength != 0)
+    posix_fadvise(vol->imageid, vol->base + clusterOffset(runStart),
+                  (off_t)runLength*vol->bytesPerCluster, POSIX_FADV_WILLNEED);
+
+  return advised;
+}
+
+/** readAheadFile - keeps a file's read-ahead window readAheadClusters
+                    ahead of the cluster at index the reader is in, topping
+                    it up once the reader passes its middle; clusters is
+                    the length of the file in clusters
+ **/
+void readAheadFile(fatedit_file *f, unsigned int cluster, unsigned int index,
+                   unsigned int clusters) {
+  unsigned int want;
+
+  if (readAheadClusters <= 0)
+    return;
+
+  // start over from the reader after a seek past the window or back
+  if (index >= f->raEnd || f->raEnd - index > (unsigned int)readAheadClusters) {
+    f->raEnd = index;
+    f->raLast = 0;
+  }
+  if (f->raEnd - index > (unsigned int)readAheadClusters/2)
+    return;
+
+  want = index + readAheadClusters;
+  if (want > clusters)
+    want = clusters;
+  if (want <= f->raEnd)
+    return;
+  f->raEnd += readAhead(f->raLast != 0 ? getNextCluster(f->raLast) & 0x0FFFFFFF : cluster,
+                        want - f->raEnd, &f->raLast);
+}
+
+/** eraseClusterChain - overwrites every cluster of a chain with zeros,
+                        submitting the writes in batches
+ **/
+void eraseClusterChain(unsigned int startCluster) {
+  io_request reqs[IO_QUEUE_DEPTH];
+  char *zeros;
+  unsigned int cluster;
+  int count;
+
+  zeros = (char*)calloc(1, vol->bytesPerCluster);
+  count = 0;
+  for (cluster = startCluster; cluster >= 2 && cluster < EoC;
+       cluster = getNextCluster(cluster)) {
+    reqs[count].write = 1;
+    reqs[count].buf = zeros;
+    reqs[count].len = vol->bytesPerCluster;
+    reqs[count].offset = (off_t)firstSectorOfCluster(cluster)*vol->bytesPerSector;
+    if (++count == IO_QUEUE_DEPTH) {
+      ioBatch(reqs, count);
+      count = 0;
+    }
+  }
+  if (count != 0)
+    ioBatch(reqs, count);
+
+  free(zeros);
+}
+
+/** combineShorts - combines two shorts into a long properly
+ **/
+unsigned int combineShorts(unsigned short high, unsigned short low) {
+  return ((high<<16) | low);
+}
+
+/** newCluster - allocates a new cluster and updates the FATs accordingly,
+                 zeroing all but the first keep bytes which the caller is
+                 about to overwrite
+ **/
+unsigned int newCluster(unsigned int linkedCluster, unsigned int keep) {
+  unsigned int freeLocation;
+  int failed;
+
+  // check for no free space
+  freeLocation = findFreeCluster();
+  if (freeLocation == 0)
+    return 0;
+  vol->nextFreeLocation = freeLocation + 1 < vol->numClusters+2 ? freeLocation + 1 : 2;
+
+  // update new block to EoC value
+  setFATEntry(freeLocation, EoC);
+  // update linkedCluster FAT entry to new free block location
+  if (linkedCluster != 0)
+    setFATEntry(linkedCluster, freeLocation);
+
+  // clear out the data the caller won't write, whole clusters go straight
+  // to the image so long gaps don't stream through the cache; a cluster
+  // that can't be cleared is given back rather than exposing old data
+  if (keep == 0)
+    failed = ioZero(clusterOffset(freeLocation), vol->bytesPerCluster);
+  else if (keep < vol->bytesPerCluster)
+    failed = zeroImage(clusterOffset(freeLocation) + keep, vol->bytesPerCluster - keep);
+  else
+    failed = 0;
+  if (failed) {
+    if (linkedCluster != 0)
+      setFATEntry(linkedCluster, EoC);
+    setFATEntry(freeLocation, EMPTY);
+    return 0;
+  }
+
+  return freeLocation;
+}
+
+/** newDirectoryCluster - allocates a new directory cluster and updates
+                          the FATs accordingly
+ **/
+unsigned int newDirectoryCluster() {
+  // a fresh directory cluster is an unlinked, zeroed cluster
+  return newCluster(0, 0);
+}
+
+/** clearClusterChain - clears out a cluster chain
+ **/
+void clearClusterChain(unsigned int startCluster) {
+  unsigned int nextCluster;
+
+  // free every cluster until the end of the chain
+  while (startCluster >= 2 && startCluster < EoC) {
+    nextCluster = getNextCluster(startCluster);
+    setFATEntry(startCluster, EMPTY);
+    startCluster = nextCluster;
+  }
+}
+
+/** convertFilename - converts a filename to a proper short filename
+ **/
+void convertFilename(char *filename) {
+  // check for dot entries
+  int i, j;
+  char *temp;
+  int dot_entry = 0;
+  if (strcmp(filename,".") == 0) {
+    temp = ".          ";
+    dot_entry = 1;
+  } else if (strcmp(filename,"..") == 0) {
+    temp = "..         ";
+    dot_entry = 1;
+  }
+  if (dot_entry) {
+    strcpy(filename,temp);
+    return;
+  }
+
+  // otherwise convert normally, in place
+  char old_filename[BUFFER_SIZE+1];
+  strncpy(old_filename,filename,BUFFER_SIZE);
+  old_filename[BUFFER_SIZE] = 0;
+
+  memset(filename,' ',11);
+  filename[11] = 0;
+
+  // extension starts after the 8 name characters
+  for (i = 0, j = 0; old_filename[i] != 0 && j < 11; i++) {
+    if (old_filename[i] == '.' && j <= 8)
+      j = 8;
+    else
+      filename[j++] = toupper(old_filename[i]);
+  }
+}
+
+/** removeTailWhitespace - removes trailing whitespace in FAT32 short filenames
+ **/
+void removeTailWhitespace(char *filename) {
+  int i;
+  for (i = strlen(filename)-1; i >= 0 && filename[i] == ' '; i--) {
+    filename[i] = 0;
+  }
+}
+
+/** formatFilename - turns a space padded short filename into NAME.EXT
+ **/
+void formatFilename(char *shortname, char *name) {
+  int i, j;
+
+  for (i = 0, j = 0; i < 8 && shortname[i] != ' '; i++)
+    name[j++] = shortname[i];
+  if (shortname[8] != ' ') {
+    name[j++] = '.';
+    for (i = 8; i < 11 && shortname[i] != ' '; i++)
+      name[j++] = shortname[i];
+  }
+  name[j] = 0;
+}
+
+/** makeDirEntry - fills in a 32 byte short directory entry
+ **/
+void makeDirEntry(char *entry, char *shortname, char attr,
+                  unsigned int cluster, unsigned int size) {
+  unsigned short clusHigh, clusLow, date;
+
+  clusHigh = cluster >> 16;
+  clusLow = cluster & 0xFFFF;
+  // fixed 2000-01-01 date keeps generated images reproducible
+  date = ((2000-1980) << 9) | (1 << 5) | 1;
+
+  memset(entry, 0, 32);
+  memcpy(&entry[0], shortname, 11);
+  entry[11] = attr;
+  memcpy(&entry[16], &date, 2);
+  memcpy(&entry[18], &date, 2);
+  memcpy(&entry[20], &clusHigh, 2);
+  memcpy(&entry[24], &date, 2);
+  memcpy(&entry[26], &clusLow, 2);
+  memcpy(&entry[28], &size, 4);
+}
+
+/** mkfsAllocCluster - takes the next free cluster of the volume being
+                       formatted and links it after linkedCluster
+ **/
+unsigned int mkfsAllocCluster(unsigned int linkedCluster) {
+  unsigned int cluster;
+
+  // check for no free space
+  if (mkfsNextCluster >= mkfsClusterCount+2)
+    return 0;
+
+  cluster = mkfsNextCluster++;
+  mkfsFAT = (unsigned int*)realloc(mkfsFAT, mkfsNextCluster*sizeof(unsigned int));
+  mkfsFAT[cluster] = 0x0FFFFFFF;
+  if (linkedCluster != 0)
+    mkfsFAT[linkedCluster] = cluster;
+
+  return cluster;
+}
+
+/** mkfsPopulate - writes a synthetic directory with files and, while level
+                   is positive, subdirectories into the given cluster
+ **/
+int mkfsPopulate(unsigned int dirCluster, unsigned int parentCluster, int level) {
+  char *entries, *data;
+  char shortname[12];
+  io_request reqs[MKFS_MAX_FILE_CLUSTERS];
+  int numEntries, maxEntries, perCluster, i, k, n;
+  unsigned int size, cluster, firstCluster, written, chunk;
+
+  maxEntries = 2 + mkfsOpts.files + (level > 0 ? mkfsOpts.subdirs : 0);
+  entries = (char*)malloc(maxEntries*32);
+  data = (char*)malloc(MKFS_MAX_FILE_CLUSTERS*vol->bytesPerCluster);
+  numEntries = 0;
+
+  // dot entries for everything but the root directory
+  if (dirCluster != vol->rootCluster) {
+    makeDirEntry(&entries[32*numEntries++], ".          ", SUB_DIRECTORY, dirCluster, 0);
+    makeDirEntry(&entries[32*numEntries++], "..         ", SUB_DIRECTORY,
+                 parentCluster == vol->rootCluster ? 0 : parentCluster, 0);
+  }
+
+  // files of pseudo-random size and content, each written as one batch
+  for (i = 0; i < mkfsOpts.files; i++) {
+    size = mkfsRandom() % (MKFS_MAX_FILE_CLUSTERS*vol->bytesPerCluster + 1);
+    firstCluster = cluster = 0;
+    for (k = 0; k < size; k++)
+      data[k] = 'a' + mkfsRandom() % 26;
+    for (written = 0, n = 0; written < size; written += chunk, n++) {
+      cluster = mkfsAllocCluster(cluster);
+      if (cluster == 0) {
+        free(entries);
+        free(data);
+        return 1;
+      }
+      if (firstCluster == 0)
+        firstCluster = cluster;
+      chunk = size - written < vol->bytesPerCluster ? size - written : vol->bytesPerCluster;
+      reqs[n].write = 1;
+      reqs[n].buf = &data[written];
+      reqs[n].len = chunk;
+      reqs[n].offset = (off_t)firstSectorOfCluster(cluster)*vol->bytesPerSector;
+    }
+    ioBatch(reqs, n);
+    snprintf(shortname, sizeof(shortname), "FILE%04dDAT", i % 10000);
+    makeDirEntry(&entries[32*numEntries++], shortname, 0, firstCluster, size);
+  }
+
+  // subdirectories
+  for (i = 0; level > 0 && i < mkfsOpts.subdirs; i++) {
+    cluster = mkfsAllocCluster(0);
+    if (cluster == 0 || mkfsPopulate(cluster, dirCluster, level-1) != 0) {
+      free(entries);
+      free(data);
+      return 1;
+    }
+    snprintf(shortname, sizeof(shortname), "DIR%05d   ", i % 100000);
+    makeDirEntry(&entries[32*numEntries++], shortname, SUB_DIRECTORY, cluster, 0);
+  }
+
+  // write entries, extending the directory chain as clusters fill up
+  perCluster = vol->bytesPerCluster / 32;
+  cluster = dirCluster;
+  for (i = 0; i < numEntries; i += perCluster) {
+    if (i != 0) {
+      cluster = mkfsAllocCluster(cluster);
+      if (cluster == 0) {
+        free(entries);
+        free(data);
+        return 1;
+      }
+    }
+    k = numEntries - i < perCluster ? numEntries - i : perCluster;
+    pwrite(vol->imageid, &entries[32*i], 32*k,
+           (off_t)firstSectorOfCluster(cluster)*vol->bytesPerSector);
+  }
+
+  free(entries);
+  free(data);
+  return 0;
+}
+
+/** mkfsRandom - deterministic xorshift generator for synthetic content
+ **/
+unsigned int mkfsRandom() {
+  mkfsState ^= mkfsState << 13;
+  mkfsState ^= mkfsState >> 17;
+  mkfsState ^= mkfsState << 5;
+  return mkfsState;
+}
+
+/** cacheInit - sets up an empty block cache holding up to the given
+                number of sectors
+ **/
+void cacheInit(int blocks) {
+  vol->cacheCapacity = blocks > 0 ? blocks : 1;
+  vol->cacheCount = 0;
+  vol->lruHead = vol->lruTail = NULL;
+
+  // power of two bucket count of about twice the capacity
+  for (vol->cacheBuckets = 1; vol->cacheBuckets < 2*vol->cacheCapacity; vol->cacheBuckets <<= 1);
+  vol->cacheTable = (cache_block**)calloc(vol->cacheBuckets, sizeof(cache_block*));
+}
+
+/** cacheGet - returns the cached data of a sector, reading it from the
+               image on a miss unless load is 0 because the caller is
+               about to overwrite all of it
+ **/
+char *cacheGet(unsigned int sector, int load) {
+  char *data;
+
+  data = cacheLookup(sector);
+  if (data != NULL)
+    return data;
+
+  data = cacheInsert(sector, NULL);
+  if (load && readSector(sector, data) != 0)
+    memset(data, 0, vol->bytesPerSector);
+
+  return data;
+}
+
+/** cacheLookup - returns the cached data of a sector and moves it to the
+                  front of the LRU list, or NULL on a miss
+ **/
+char *cacheLookup(unsigned int sector) {
+  cache_block *block;
+
+  for (block = vol->cacheTable[sector & (vol->cacheBuckets-1)]; block != NULL;
+       block = block->hashNext)
+    if (block->sector == sector)
+      break;
+  if (block == NULL)
+    return NULL;
+
+  if (block != vol->lruHead) {
+    block->prev->next = block->next;
+    if (block->next != NULL)
+      block->next->prev = block->prev;
+    else
+      vol->lruTail = block->prev;
+    block->prev = NULL;
+    block->next = vol->lruHead;
+    vol->lruHead->prev = block;
+    vol->lruHead = block;
+  }
+
+  return block->data;
+}
+
+/** cacheInsert - adds a sector that isn't cached at the front of the LRU
+                  list, taking a new block or evicting the least recently
+                  used one, filled from contents or zeros when it is NULL
+ **/
+char *cacheInsert(unsigned int sector, char *contents) {
+  cache_block *block, **link;
+  unsigned int bucket;
+
+  if (vol->cacheCount < vol->cacheCapacity) {
+    block = (cache_block*)malloc(sizeof(cache_block) + vol->bytesPerSector);
+    vol->cacheCount++;
+  }
+  else {
+    block = vol->lruTail;
+    if (block->dirty) {
+      writeSector(block->sector, block->data);
+      vol->cacheDirty--;
+    }
+    for (link = &vol->cacheTable[block->sector & (vol->cacheBuckets-1)]; *link != block;
+         link = &(*link)->hashNext);
+    *link = block->hashNext;
+    vol->lruTail = block->prev;
+    if (vol->lruTail != NULL)
+      vol->lruTail->next = NULL;
+    else
+      vol->lruHead = NULL;
+  }
+
+  block->sector = sector;
+  block->dirty = 0;
+  if (contents != NULL)
+    memcpy(block->data, contents, vol->bytesPerSector);
+  else
+    memset(block->data, 0, vol->bytesPerSector);
+
+  bucket = sector & (vol->cacheBuckets-1);
+  block->hashNext = vol->cacheTable[bucket];
+  vol->cacheTable[bucket] = block;
+  block->prev = NULL;
+  block->next = vol->lruHead;
+  if (vol->lruHead != NULL)
+    vol->lruHead->prev = block;
+  vol->lruHead = block;
+  if (vol->lruTail == NULL)
+    vol->lruTail = block;
+
+  return block->data;
+}
+
+/** cacheRelease - writes back and drops every cached sector overlapping
+                   a byte range that is about to be accessed directly
+ **/
+void cacheRelease(off_t offset, unsigned int len) {
+  cache_block *block, **link;
+  unsigned int sector, last;
+
+  if (vol->cacheTable == NULL || len == 0)
+    return;
+
+  pthread_mutex_lock(&vol->cacheLock);
+  last = (offset + len - 1) >> vol->sectorShift;
+  for (sector = offset >> vol->sectorShift; sector <= last; sector++) {
+    for (link = &vol->cacheTable[sector & (vol->cacheBuckets-1)];
+         *link != NULL && (*link)->sector != sector;
+         link = &(*link)->hashNext);
+    if ((block = *link) == NULL)
+      continue;
+
+    if (block->dirty) {
+      writeSector(sector, block->data);
+      vol->cacheDirty--;
+    }
+    *link = block->hashNext;
+    if (block->prev != NULL)
+      block->prev->next = block->next;
+    else
+      vol->lruHead = block->next;
+    if (block->next != NULL)
+      block->next->prev = block->prev;
+    else
+      vol->lruTail = block->prev;
+    free(block);
+    vol->cacheCount--;
+  }
+  pthread_mutex_unlock(&vol->cacheLock);
+}
+
+/** cacheFlush - writes every dirty cached sector back to the image in
+                 sector order, a run of consecutive sectors per write,
+                 returns nonzero if a write failed
+ **/
+int cacheFlush() {
+  cache_block *block, **dirty;
+  struct iovec iov[FLUSH_IOV];
+  int failed, count, i, run;
+
+  failed = 0;
+  pthread_mutex_lock(&vol->cacheLock);
+  if (vol->cacheDirty == 0) {
+    pthread_mutex_unlock(&vol->cacheLock);
+    return 0;
+  }
+
+  // write the dirty blocks in sector order
+  dirty = (cache_block**)malloc(vol->cacheDirty*sizeof(cache_block*));
+  count = 0;
+  for (block = vol->lruHead; block != NULL && count < vol->cacheDirty; block = block->next)
+    if (block->dirty)
+      dirty[count++] = block;
+  qsort(dirty, count, sizeof(cache_block*), blockOrder);
+
+  for (i = 0; i < count; i += run) {
+    // the delta file keeps its own sector order
+    if (vol->overlayid >= 0) {
+      if (writeSector(dirty[i]->sector, dirty[i]->data) != 0)
+        failed = 1;
+      run = 1;
+      continue;
+    }
+
+    // one write per run of consecutive sectors
+    for (run = 0; i+run < count && run < FLUSH_IOV &&
+         dirty[i+run]->sector == dirty[i]->sector + run; run++) {
+      iov[run].iov_base = dirty[i+run]->data;
+      iov[run].iov_len = vol->bytesPerSector;
+    }
+    if (pwritev(vol->imageid, iov, run,
+                vol->base + (off_t)dirty[i]->sector*vol->bytesPerSector) !=
+        (ssize_t)run*vol->bytesPerSector)
+      failed = 1;
+  }
+  for (i = 0; i < count; i++)
+    dirty[i]->dirty = 0;
+  vol->cacheDirty = 0;
+  free(dirty);
+  pthread_mutex_unlock(&vol->cacheLock);
+
+  return failed;
+}
+
+/** blockOrder - orders cache blocks by sector for qsort
+ **/
+int blockOrder(const void *a, const void *b) {
+  unsigned int x, y;
+
+  x = (*(cache_block**)a)->sector;
+  y = (*(cache_block**)b)->sector;
+  return x < y ? -1 : x > y;
+}
+
+/** cacheInvalidate - drops every cached sector without writing it back
+ **/
+void cacheInvalidate() {
+  cache_block *block;
+
+  pthread_mutex_lock(&vol->cacheLock);
+  while ((block = vol->lruHead) != NULL) {
+    vol->lruHead = block->next;
+    free(block);
+  }
+  vol->lruTail = NULL;
+  vol->cacheCount = 0;
+  vol->cacheDirty = 0;
+  if (vol->cacheTable != NULL)
+    memset(vol->cacheTable, 0, vol->cacheBuckets*sizeof(cache_block*));
+  pthread_mutex_unlock(&vol->cacheLock);
+}
+
+/** readImage - reads bytes from the image through the block cache, the
+                cache lock is dropped while a miss is read so readers
+                don't queue behind each other's disk reads
+ **/
+int readImage(off_t offset, void *buf, unsigned int len) {
+  unsigned int in_sector, chunk, sector;
+  char *data, loaded[MAX_SSIZE];
+  off_t from;
+  int fd, failed;
+
+  pthread_mutex_lock(&vol->cacheLock);
+  while (len > 0) {
+    in_sector = offset & (vol->bytesPerSector-1);
+    chunk = vol->bytesPerSector - in_sector;
+    if (chunk > len)
+      chunk = len;
+
+    // a sector that isn't cached can't be dirty, only commands holding
+    // the volume exclusively write, so the copy on disk is current; when
+    // another reader cached it meanwhile its copy is used
+    sector = offset >> vol->sectorShift;
+    data = cacheLookup(sector);
+    if (data == NULL) {
+      fd = sectorLocation(sector, &from);
+      pthread_mutex_unlock(&vol->cacheLock);
+      failed = pread(fd, loaded, vol->bytesPerSector, from) != vol->bytesPerSector;
+      pthread_mutex_lock(&vol->cacheLock);
+      data = cacheLookup(sector);
+      if (data == NULL)
+        data = cacheInsert(sector, failed ? NULL : loaded);
+    }
+    memcpy(buf, data + in_sector, chunk);
+
+    buf = (char*)buf + chunk;
+    offset += chunk;
+    len -= chunk;
+  }
+  pthread_mutex_unlock(&vol->cacheLock);
+
+  return 0;
+}
+
+/** writeImage - writes bytes to the image through the block cache, the
+                 sectors are written back on the next flush or eviction
+ **/
+int writeImage(off_t offset, void *buf, unsigned int len) {
+  unsigned int in_sector, chunk;
+  char *data;
+
+  pthread_mutex_lock(&vol->cacheLock);
+  vol->unsynced = 1;
+  while (len > 0) {
+    in_sector = offset & (vol->bytesPerSector-1);
+    chunk = vol->bytesPerSector - in_sector;
+    if (chunk > len)
+      chunk = len;
+
+    // whole sector writes don't need the old contents
+    data = cacheGet(offset >> vol->sectorShift, chunk != vol->bytesPerSector);
+    memcpy(data + in_sector, buf, chunk);
+    // cacheGet leaves the block it returned at the head of the LRU list
+    if (!vol->lruHead->dirty) {
+      vol->lruHead->dirty = 1;
+      vol->cacheDirty++;
+    }
+
+    buf = (char*)buf + chunk;
+    offset += chunk;
+    len -= chunk;
+  }
+  pthread_mutex_unlock(&vol->cacheLock);
+
+  return 0;
+}
+
+/** zeroImage - writes zeros over bytes of the image through the block
+                cache a sector at a time, so no cluster sized buffer is
+                needed
+ **/
+int zeroImage(off_t offset, unsigned int len) {
+  char blank[MAX_SSIZE];
+  unsigned int chunk;
+
+  memset(blank, 0, vol->bytesPerSector);
+  for (; len > 0; offset += chunk, len -= chunk) {
+    chunk = vol->bytesPerSector - (offset & (vol->bytesPerSector-1));
+    if (chunk > len)
+      chunk = len;
+    if (writeImage(offset, blank, chunk) != 0)
+      return 1;
+  }
+
+  return 0;
+}
+
+/** overlayOpen - opens or creates the delta file of a copy-on-write
+                  session and indexes the sectors it already holds
+ **/
+int overlayOpen(char *file) {
+  char header[OVERLAY_HEADER];
+  unsigned int sector, headerSectorSize;
+  overlay_entry *entry;
+  off_t size;
+
+  vol->overlayid = open(file, O_RDWR | O_CREAT, 0644);
+  if (vol->overlayid < 0)
+    return 1;
+  vol->overlayname = file;
+  vol->overlayTable = (overlay_entry**)calloc(OVERLAY_BUCKETS, sizeof(overlay_entry*));
+  vol->overlayRecords = 0;
+
+  // new delta file, write header
+  size = lseek(vol->overlayid, 0, SEEK_END);
+  if (size == 0) {
+    memset(header, 0, sizeof(header));
+    memcpy(&header[0], OVERLAY_MAGIC, 8);
+    headerSectorSize = vol->bytesPerSector;
+    memcpy(&header[8], &headerSectorSize, 4);
+    if (pwrite(vol->overlayid, header, OVERLAY_HEADER, 0) != OVERLAY_HEADER)
+      return 1;
+    vol->overlayEnd = OVERLAY_HEADER;
+    return 0;
+  }
+
+  // existing session, check it belongs to a volume of this geometry
+  if (pread(vol->overlayid, header, OVERLAY_HEADER, 0) != OVERLAY_HEADER ||
+      memcmp(&header[0], OVERLAY_MAGIC, 8) != 0)
+    return 1;
+  memcpy(&headerSectorSize, &header[8], 4);
+  if (headerSectorSize != vol->bytesPerSector)
+    return 1;
+
+  // index records, each a sector number followed by the sector data
+  for (vol->overlayEnd = OVERLAY_HEADER;
+       vol->overlayEnd + 4 + vol->bytesPerSector <= size;
+       vol->overlayEnd += 4 + vol->bytesPerSector) {
+    pread(vol->overlayid, &sector, 4, vol->overlayEnd);
+    entry = (overlay_entry*)malloc(sizeof(overlay_entry));
+    entry->sector = sector;
+    entry->offset = vol->overlayEnd + 4;
+    entry->next = vol->overlayTable[sector % OVERLAY_BUCKETS];
+    vol->overlayTable[sector % OVERLAY_BUCKETS] = entry;
+    vol->overlayRecords++;
+  }
+
+  return 0;
+}
+
+/** overlayLookup - returns the delta file entry of a sector, or NULL when
+                    the sector was never written during the session
+ **/
+overlay_entry *overlayLookup(unsigned int sector) {
+  overlay_entry *entry;
+
+  for (entry = vol->overlayTable[sector % OVERLAY_BUCKETS]; entry != NULL; entry = entry->next)
+    if (entry->sector == sector)
+      return entry;
+
+  return NULL;
+}
+
+/** overlayCommit - copies every sector of the delta file into the image,
+                    overlayDiscard then empties it
+ **/
+int overlayCommit() {
+  overlay_entry *entry;
+  char *data;
+  int baseid, i, failed;
+
+  // push pending writes into the delta file first
+  if (flushOpenEntries() != 0 || syncVolume() != 0)
+    return 1;
+
+  baseid = open(vol->imagename, O_RDWR);
+  if (baseid < 0)
+    return 1;
+
+  failed = 0;
+  data = (char*)malloc(vol->bytesPerSector);
+  for (i = 0; i < OVERLAY_BUCKETS; i++) {
+    for (entry = vol->overlayTable[i]; entry != NULL; entry = entry->next) {
+      if (pread(vol->overlayid, data, vol->bytesPerSector, entry->offset) != vol->bytesPerSector ||
+          pwrite(baseid, data, vol->bytesPerSector,
+                 vol->base + (off_t)entry->sector*vol->bytesPerSector) != vol->bytesPerSector)
+        failed = 1;
+    }
+  }
+  free(data);
+
+  // only drop the delta once the image is durable
+  if (fsync(baseid) != 0)
+    failed = 1;
+  close(baseid);
+  return failed;
+}
+
+/** overlayDiscard - throws away every change made during the session and
+                     cuts the delta file back to its header, the overlay
+                     stays in use
+ **/
+int overlayDiscard() {
+  open_entry *oe;
+  overlay_entry *entry;
+  int i;
+
+  cacheInvalidate();
+  for (i = 0; i < OVERLAY_BUCKETS; i++) {
+    while ((entry = vol->overlayTable[i]) != NULL) {
+      vol->overlayTable[i] = entry->next;
+      free(entry);
+    }
+  }
+  vol->overlayRecords = 0;
+
+  if (ftruncate(vol->overlayid, OVERLAY_HEADER) != 0)
+    return 1;
+  vol->overlayEnd = OVERLAY_HEADER;
+
+  // open files forget their changes too
+  for (oe = vol->openEntries; oe != NULL; oe = oe->next)
+    oe->dirty = 0;
+
+  // the counters changed along with the discarded sectors
+  if (vol->fsinfo != 0) {
+    readImage(vol->fsinfo*vol->bytesPerSector + 488, &vol->freeClusters, 4);
+    readImage(vol->fsinfo*vol->bytesPerSector + 492, &vol->nextFreeLocation, 4);
+  }
+  vol->fsInfoDirty = 0;
+
+  return 0;
+}
+
+/** overlayClose - stops using the delta file and removes it
+ **/
+int overlayClose() {
+  close(vol->overlayid);
+  vol->overlayid = -1;
+
+  return unlink(vol->overlayname);
+}
+
+/** overlayTransfer - performs one batched request sector by sector so it
+                      reads through and writes into the delta file
+ **/
+int overlayTransfer(io_request *req) {
+  char *data;
+  unsigned int in_sector, chunk, sector, done;
+
+  data = (char*)malloc(vol->bytesPerSector);
+  for (done = 0; done < req->len; done += chunk) {
+    sector = (req->offset + done) >> vol->sectorShift;
+    in_sector = (req->offset + done) & (vol->bytesPerSector-1);
+    chunk = vol->bytesPerSector - in_sector;
+    if (chunk > req->len - done)
+      chunk = req->len - done;
+
+    // partial sectors need the current contents
+    if (!req->write || chunk != vol->bytesPerSector)
+      if (readSector(sector, data) != 0) {
+        free(data);
+        return 1;
+      }
+    if (req->write) {
+      memcpy(data + in_sector, req->buf + done, chunk);
+      if (writeSector(sector, data) != 0) {
+        free(data);
+        return 1;
+      }
+    }
+    else
+      memcpy(req->buf + done, data + in_sector, chunk);
+  }
+  free(data);
+
+  return 0;
+}
+
+/** readSector - reads one sector from the delta file when the session has
+                 written it, otherwise from the image
+ **/
+int readSector(unsigned int sector, char *buf) {
+  off_t offset;
+  int fd;
+
+  fd = sectorLocation(sector, &offset);
+  return pread(fd, buf, vol->bytesPerSector, offset) != vol->bytesPerSector;
+}
+
+/** sectorLocation - returns the file holding the latest copy of a sector,
+                     the delta file once the session wrote it, and leaves
+                     its offset there in offset
+ **/
+int sectorLocation(unsigned int sector, off_t *offset) {
+  overlay_entry *entry;
+
+  if (vol->overlayid >= 0 && (entry = overlayLookup(sector)) != NULL) {
+    *offset = entry->offset;
+    return vol->overlayid;
+  }
+
+  *offset = vol->base + (off_t)sector*vol->bytesPerSector;
+  return vol->imageid;
+}
+
+/** writeSector - writes one sector to the image, or to the delta file
+                  during a copy-on-write session
+ **/
+int writeSector(unsigned int sector, char *buf) {
+  overlay_entry *entry;
+
+  if (vol->overlayid < 0)
+    return pwrite(vol->imageid, buf, vol->bytesPerSector,
+                  vol->base + (off_t)sector*vol->bytesPerSector) != vol->bytesPerSector;
+
+  // rewrite the sector's record in place, or append a new one
+  entry = overlayLookup(sector);
+  if (entry == NULL) {
+    if (pwrite(vol->overlayid, &sector, 4, vol->overlayEnd) != 4)
+      return 1;
+    entry = (overlay_entry*)malloc(sizeof(overlay_entry));
+    entry->sector = sector;
+    entry->offset = vol->overlayEnd + 4;
+    entry->next = vol->overlayTable[sector % OVERLAY_BUCKETS];
+    vol->overlayTable[sector % OVERLAY_BUCKETS] = entry;
+    vol->overlayEnd += 4 + vol->bytesPerSector;
+    vol->overlayRecords++;
+  }
+
+  return pwrite(vol->overlayid, buf, vol->bytesPerSector, entry->offset) != vol->bytesPerSector;
+}
+
+/** ioInit - sets up the io_uring rings used for batched I/O, returns
+             nonzero when the kernel does not provide io_uring or its read
+             and write operations
+ **/
+int ioInit() {
+#ifdef HAVE_IO_URING
+  struct io_uring_params params;
+  struct io_uring_probe *probe;
+  size_t sqSize, cqSize;
+  char *sq, *cq;
+  int fd, supported;
+
+  memset(&params, 0, sizeof(params));
+  fd = syscall(__NR_io_uring_setup, IO_QUEUE_DEPTH, &params);
+  if (fd < 0)
+    return 1;
+
+  // IORING_OP_READ and IORING_OP_WRITE arrived in 5.6 along with probing,
+  // older kernels would fail every request, so they keep pread and pwrite
+  probe = (struct io_uring_probe*)calloc(1, sizeof(struct io_uring_probe) +
+                                            IORING_OP_LAST*sizeof(struct io_uring_probe_op));
+  supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+                      probe, IORING_OP_LAST) == 0 &&
+              probe->last_op >= IORING_OP_WRITE &&
+              (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+              (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  if (!supported) {
+    close(fd);
+    return 1;
+  }
+
+  // map submission queue, completion queue and submission entries
+  sqSize = params.sq_off.array + params.sq_entries*sizeof(unsigned int);
+  cqSize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cqSize > sqSize)
+      sqSize = cqSize;
+    cqSize = sqSize;
+  }
+  sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) {
+    close(fd);
+    return 1;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    cq = sq;
+  else {
+    cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) {
+      close(fd);
+      return 1;
+    }
+  }
+  ring.sqes = mmap(NULL, params.sq_entries*sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_SQES);
+  if (ring.sqes == MAP_FAILED) {
+    close(fd);
+    return 1;
+  }
+
+  ring.sqHead = (unsigned int*)(sq + params.sq_off.head);
+  ring.sqTail = (unsigned int*)(sq + params.sq_off.tail);
+  ring.sqMask = (unsigned int*)(sq + params.sq_off.ring_mask);
+  ring.sqArray = (unsigned int*)(sq + params.sq_off.array);
+  ring.cqHead = (unsigned int*)(cq + params.cq_off.head);
+  ring.cqTail = (unsigned int*)(cq + params.cq_off.tail);
+  ring.cqMask = (unsigned int*)(cq + params.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  ring.entries = params.sq_entries;
+  ring.fd = fd;
+
+  return 0;
+#else
+  return 1;
+#endif
+}
+
+/** ioBatch - performs a batch of positioned reads and writes on the image,
+              through io_uring when available, returns nonzero on failure
+ **/
+int ioBatch(io_request *reqs, int count) {
+  int i, result;
+
+  // keep the block cache coherent with the direct transfers
+  for (i = 0; i < count; i++) {
+    cacheRelease(reqs[i].offset, reqs[i].len);
+    if (reqs[i].write)
+      vol->unsynced = 1;
+  }
+
+#ifdef HAVE_IO_URING
+  // one ring is shared by every volume
+  if (ring.fd >= 0 && vol->overlayid < 0) {
+    pthread_mutex_lock(&ringLock);
+    result = ioSubmitUring(reqs, count);
+    pthread_mutex_unlock(&ringLock);
+    return result;
+  }
+#endif
+  // the delta file index is guarded with the cache
+  if (vol->overlayid >= 0)
+    pthread_mutex_lock(&vol->cacheLock);
+  result = ioSubmitPositioned(reqs, count);
+  if (vol->overlayid >= 0)
+    pthread_mutex_unlock(&vol->cacheLock);
+  return result;
+}
+
+/** ioSubmitUring - queues the whole batch on the submission ring and reaps
+                    the completions with one io_uring_enter per ring's worth
+ **/
+int ioSubmitUring(io_request *reqs, int count) {
+#ifdef HAVE_IO_URING
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  unsigned int tail, head, index;
+  int submitted, reaped, chunk, queued, inFlight, failed, i, ret;
+
+  failed = 0;
+  for (submitted = 0; submitted < count; submitted += chunk) {
+    chunk = count - submitted;
+    if (chunk > ring.entries)
+      chunk = ring.entries;
+
+    // fill in submission entries
+    tail = *ring.sqTail;
+    for (i = submitted; i < submitted + chunk; i++, tail++) {
+      index = tail & *ring.sqMask;
+      sqe = &ring.sqes[index];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = reqs[i].write ? IORING_OP_WRITE : IORING_OP_READ;
+      sqe->fd = vol->imageid;
+      sqe->addr = (unsigned long)reqs[i].buf;
+      sqe->len = reqs[i].len;
+      sqe->off = vol->base + reqs[i].offset;
+      sqe->user_data = i;
+      ring.sqArray[index] = index;
+    }
+    __atomic_store_n(ring.sqTail, tail, __ATOMIC_RELEASE);
+
+    // submit and wait for the whole chunk in one call
+    reaped = 0;
+    ret = syscall(__NR_io_uring_enter, ring.fd, chunk, chunk,
+                  IORING_ENTER_GETEVENTS, NULL, 0);
+
+    // entries the kernel didn't take, because the call failed or stopped
+    // at a bad one, are taken back off the ring so the next batch doesn't
+    // submit them again, and are done with pread and pwrite instead
+    queued = tail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE);
+    inFlight = chunk - queued;
+    if (queued > 0) {
+      __atomic_store_n(ring.sqTail, tail - queued, __ATOMIC_RELEASE);
+      failed |= ioSubmitPositioned(&reqs[submitted + inFlight], queued);
+    }
+
+    // reap every completion of what was submitted before returning, even
+    // after a failure, so none is left for the next batch to pick up
+    while (reaped < inFlight) {
+      if (ret < 0 && errno != EINTR) {
+        // the completions can't be waited for, retire the ring so later
+        // batches don't mistake them for their own
+        close(ring.fd);
+        ring.fd = -1;
+        return 1;
+      }
+      head = *ring.cqHead;
+      while (head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE)) {
+        cqe = &ring.cqes[head & *ring.cqMask];
+        i = cqe->user_data;
+        // finish short transfers synchronously
+        if (cqe->res < 0)
+          failed = 1;
+        else if (cqe->res < reqs[i].len) {
+          io_request rest = reqs[i];
+          rest.buf += cqe->res;
+          rest.len -= cqe->res;
+          rest.offset += cqe->res;
+          failed |= ioSubmitPositioned(&rest, 1);
+        }
+        head++;
+        reaped++;
+      }
+      __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+      if (reaped < inFlight)
+        ret = syscall(__NR_io_uring_enter, ring.fd, 0, inFlight - reaped,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+    }
+  }
+
+  return failed;
+#else
+  return ioSubmitPositioned(reqs, count);
+#endif
+}
+
+/** ioSubmitPositioned - pread/pwrite fallback for ioBatch
+ **/
+int ioSubmitPositioned(io_request *reqs, int count) {
+  unsigned int done;
+  ssize_t ret;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    // overlay sessions go through the sector layer
+    if (vol->overlayid >= 0) {
+      if (overlayTransfer(&reqs[i]) != 0)
+        return 1;
+      continue;
+    }
+
+    for (done = 0; done < reqs[i].len; done += ret) {
+      if (reqs[i].write)
+        ret = pwrite(vol->imageid, reqs[i].buf + done, reqs[i].len - done,
+                     vol->base + reqs[i].offset + done);
+      else
+        ret = pread(vol->imageid, reqs[i].buf + done, reqs[i].len - done,
+                    vol->base + reqs[i].offset + done);
+      if (ret < 0 && errno == EINTR)
+        ret = 0;
+      else if (ret <= 0)
+        return 1;
+    }
+  }
+
+  return 0;
+}
+
+/** ioCopy - copies a byte range of the image to another one that doesn't
+             overlap it, in the kernel with copy_file_range when writes go
+             to the image and through a large buffer otherwise
+ **/
+int ioCopy(off_t from, off_t to, off_t len) {
+  io_request req;
+  char *data;
+  ssize_t ret;
+
+  cacheRelease(from, len);
+  cacheRelease(to, len);
+  vol->unsynced = 1;
+
+  // the kernel may share or offload the copy, stop at the first refusal
+  while (vol->overlayid < 0 && len > 0) {
+    from += vol->base;
+    to += vol->base;
+    ret = copy_file_range(vol->imageid, &from, vol->imageid, &to, len, 0);
+    from -= vol->base;
+    to -= vol->base;
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      break;
+    len -= ret;
+  }
+
+  data = len > 0 ? (char*)malloc(len < COPY_BUFFER ? len : COPY_BUFFER) : NULL;
+  while (len > 0) {
+    req.buf = data;
+    req.len = len < COPY_BUFFER ? len : COPY_BUFFER;
+    req.write = 0;
+    req.offset = from;
+    if (ioBatch(&req, 1) != 0)
+      break;
+    req.write = 1;
+    req.offset = to;
+    if (ioBatch(&req, 1) != 0)
+      break;
+    from += req.len;
+    to += req.len;
+    len -= req.len;
+  }
+  free(data);
+
+  return len > 0;
+}
+
+/** ioZero - zeroes a byte range of the image, letting the filesystem
+             holding the image do it when writes go to the image; punching
+             a hole keeps a sparse image sparse
+ **/
+int ioZero(off_t to, off_t len) {
+  io_request req;
+  char *data;
+
+  cacheRelease(to, len);
+  vol->unsynced = 1;
+  if (vol->overlayid < 0 && len > 0 &&
+      (fallocate(vol->imageid, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                 vol->base + to, len) == 0 ||
+       fallocate(vol->imageid, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+                 vol->base + to, len) == 0))
+    return 0;
+
+  data = len > 0 ? (char*)calloc(len < COPY_BUFFER ? len : COPY_BUFFER, 1) : NULL;
+  while (len > 0) {
+    req.buf = data;
+    req.len = len < COPY_BUFFER ? len : COPY_BUFFER;
+    req.write = 1;
+    req.offset = to;
+    if (ioBatch(&req, 1) != 0)
+      break;
+    to += req.len;
+    len -= req.len;
+  }
+  free(data);
+
+  return len > 0;
+}
+
+/** clusterOffset - returns the image offset of the first byte of a cluster
+ **/
+off_t clusterOffset(unsigned int cluster) {
+  return ((off_t)(cluster-2) << vol->clusterShift) +
+         ((off_t)vol->firstDataSector << vol->sectorShift);
+}
+
+/** entryCluster - returns the first cluster stored in a directory entry
+ **/
+unsigned int entryCluster(char *entry) {
+  unsigned short clusHigh, clusLow;
+
+  memcpy(&clusHigh, &entry[20], 2);
+  memcpy(&clusLow, &entry[26], 2);
+
+  return combineShorts(clusHigh,clusLow);
+}
+
+/** setEntryCluster - stores the first cluster in a directory entry
+ **/
+void setEntryCluster(char *entry, unsigned int cluster) {
+  unsigned short clusHigh, clusLow;
+
+  clusHigh = cluster >> 16;
+  clusLow = cluster & 0xFFFF;
+  memcpy(&entry[20], &clusHigh, 2);
+  memcpy(&entry[26], &clusLow, 2);
+}
+
+/** dirOpen - starts a walk over the directory beginning at cluster
+ **/
+void dirOpen(dir_cursor *c, unsigned int cluster) {
+  c->cluster = cluster;
+  c->offset = -1;
+}
+
+/** dirNext - steps to the next entry slot of a directory, reading a sector
+              at a time, returns nonzero past the end of the chain
+ **/
+int dirNext(dir_cursor *c) {
+  unsigned int nextCluster;
+
+  if (c->offset < 0) {
+    c->offset = clusterOffset(c->cluster);
+    c->end = c->offset + vol->bytesPerCluster;
+  }
+  else if ((c->offset += 32) == c->end) {
+    // follow the chain, leaving cluster on the last one at the end
+    nextCluster = getNextCluster(c->cluster) & 0x0FFFFFFF;
+    if (nextCluster < 2 || nextCluster >= EoC)
+      return 1;
+    c->cluster = nextCluster;
+    c->offset = clusterOffset(c->cluster);
+    c->end = c->offset + vol->bytesPerCluster;
+  }
+
+  if ((c->offset & (vol->bytesPerSector-1)) == 0)
+    readImage(c->offset, c->data, vol->bytesPerSector);
+  c->entry = &c->data[c->offset & (vol->bytesPerSector-1)];
+
+  return 0;
+}
+
+/** matchEntries - returns the index of the first of count entries that
+                   ends the directory or holds the name in pattern, or
+                   count when none does; an entry matches when its first
+                   16 bytes masked with mask equal pattern
+ **/
+int matchEntries(char *entries, int count, char *pattern, char *mask) {
+#ifdef HAVE_SSE2
+  if (__builtin_cpu_supports("avx2"))
+    return matchEntriesAVX2(entries, count, pattern, mask);
+  return matchEntriesSSE2(entries, count, pattern, mask);
+#else
+  return matchEntriesScalar(entries, count, pattern, mask);
+#endif
+}
+
+/** matchEntriesScalar - matches entries a byte at a time
+ **/
+int matchEntriesScalar(char *entries, int count, char *pattern, char *mask) {
+  int i, j;
+
+  for (i = 0; i < count; i++, entries += 32) {
+    if (entries[0] == 0x00)
+      return i;
+    for (j = 0; j < 16 && (entries[j] & mask[j]) == pattern[j]; j++);
+    if (j == 16)
+      return i;
+  }
+
+  return count;
+}
+
+#ifdef HAVE_SSE2
+/** matchEntriesSSE2 - matches an entry per compare, the name, attribute
+                       and end marker tests all come from the same load
+ **/
+int matchEntriesSSE2(char *entries, int count, char *pattern, char *mask) {
+  __m128i want, keep, zero, e;
+  int i;
+
+  want = _mm_loadu_si128((__m128i*)pattern);
+  keep = _mm_loadu_si128((__m128i*)mask);
+  zero = _mm_setzero_si128();
+  for (i = 0; i < count; i++) {
+    e = _mm_loadu_si128((__m128i*)&entries[i*32]);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(e, keep), want)) == 0xFFFF ||
+        (_mm_movemask_epi8(_mm_cmpeq_epi8(e, zero)) & 1))
+      return i;
+  }
+
+  return count;
+}
+
+/** matchEntriesAVX2 - matches two entries per compare, the first in the
+                       low half of the vector and the second in the high
+ **/
+int matchEntriesAVX2(char *entries, int count, char *pattern, char *mask) {
+  __m256i want, keep, zero, e;
+  unsigned int equal, ended;
+  int i;
+
+  want = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)pattern));
+  keep = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)mask));
+  zero = _mm256_setzero_si256();
+  for (i = 0; i + 1 < count; i += 2) {
+    e = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((__m128i*)&entries[i*32])),
+                                _mm_loadu_si128((__m128i*)&entries[i*32+32]), 1);
+    equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(e, keep), want));
+    ended = _mm256_movemask_epi8(_mm256_cmpeq_epi8(e, zero));
+    if ((equal & 0xFFFF) == 0xFFFF || (ended & 1))
+      return i;
+    if ((equal >> 16) == 0xFFFF || (ended & 0x10000))
+      return i+1;
+  }
+  if (i < count)
+    i += matchEntriesSSE2(&entries[i*32], 1, pattern, mask);
+
+  return i;
+}
+#endif
+
+/** findEntry - looks up a short name in a directory, copying out the
+                entry and its image offset
+ **/
+int findEntry(unsigned int dirCluster, char *shortname, char *entry, off_t *offset) {
+  char pattern[16], mask[16], data[DIR_SCAN_BYTES];
+  unsigned int cluster, inCluster, chunk;
+  open_entry *oe;
+  int count, i;
+
+  // free and end markers never match a name
+  if (shortname[0] == FREE || shortname[0] == 0x00)
+    return FATEDIT_ENOENT;
+
+  // the name must match and the attributes lack the volume label bit,
+  // which long entry names carry too
+  memset(pattern, 0, 16);
+  memset(mask, 0, 16);
+  memcpy(pattern, shortname, 11);
+  memset(mask, 0xFF, 11);
+  mask[11] = VOLUME_ID;
+
+  // fetch the directory up to DIR_SCAN_BYTES at a time and test every
+  // entry of a fetch at once
+  chunk = vol->bytesPerCluster < DIR_SCAN_BYTES ? vol->bytesPerCluster : DIR_SCAN_BYTES;
+  count = chunk >> 5;
+  for (cluster = dirCluster; cluster >= 2 && cluster < EoC;
+       cluster = getNextCluster(cluster) & 0x0FFFFFFF) {
+    for (inCluster = 0; inCluster < vol->bytesPerCluster; inCluster += chunk) {
+      readImage(clusterOffset(cluster) + inCluster, data, chunk);
+      i = matchEntries(data, count, pattern, mask);
+      if (i == count)
+        continue;
+      if (data[i << 5] == 0x00)
+        return FATEDIT_ENOENT;
+
+      memcpy(entry, &data[i << 5], 32);
+      *offset = clusterOffset(cluster) + inCluster + (i << 5);
+      // open files may have newer sizes and times than the disk
+      if (vol->openEntries != NULL && (oe = findOpenEntry(*offset)) != NULL)
+        memcpy(entry, oe->entry, 32);
+      return FATEDIT_OK;
+    }
+  }
+
+  return FATEDIT_ENOENT;
+}
+
+/** addEntry - writes an entry into the first free slot of a directory,
+               extending the directory by a cluster when it is full
+ **/
+int addEntry(unsigned int dirCluster, char *entry, off_t *offset) {
+  dir_cursor c;
+  unsigned int cluster;
+
+  dirOpen(&c, dirCluster);
+  while (dirNext(&c) == 0) {
+    if (c.entry[0] == FREE || c.entry[0] == 0x00) {
+      *offset = c.offset;
+      return writeImage(*offset, entry, 32) == 0 ? FATEDIT_OK : FATEDIT_EIO;
+    }
+  }
+
+  // no more room, link a fresh zeroed cluster after the last one
+  cluster = newCluster(c.cluster, 0);
+  if (cluster == 0)
+    return FATEDIT_ENOSPC;
+  *offset = clusterOffset(cluster);
+
+  return writeImage(*offset, entry, 32) == 0 ? FATEDIT_OK : FATEDIT_EIO;
+}
+
+/** removeEntry - frees a directory entry slot, marking it as the end of
+                  the directory when nothing follows it in its cluster
+ **/
+void removeEntry(off_t offset, int erase) {
+  char entry[32], next;
+
+  readImage(offset, entry, 32);
+  next = 1;
+  if (((offset + 32 - clusterOffset(2)) & (vol->bytesPerCluster-1)) != 0)
+    readImage(offset + 32, &next, 1);
+
+  if (erase)
+    memset(entry, 0, 32);
+  entry[0] = next == 0x00 ? 0x00 : 0xE5;
+  writeImage(offset, entry, 32);
+}
+
+/** lfnChecksum - returns the checksum long name entries carry of the short
+                  name they belong to
+ **/
+unsigned char lfnChecksum(char *shortname) {
+  unsigned char sum;
+  int i;
+
+  for (sum = 0, i = 0; i < 11; i++)
+    sum = ((sum & 1) << 7) + (sum >> 1) + (unsigned char)shortname[i];
+
+  return sum;
+}
+
+/** compactDirectory - moves the live entries of a directory to its front
+                       once it holds threshold free slots, releasing the
+                       clusters left empty behind them; long name entries
+                       stay in front of their short entry and are dropped
+                       when it is gone, returns the slots reclaimed
+ **/
+int compactDirectory(unsigned int dirCluster, int threshold, unsigned int *released) {
+  char pending[20*32], blank[MAX_SSIZE];
+  unsigned int writeCluster, nextCluster;
+  off_t writeOffset, writeEnd, pendingOffset[20];
+  open_entry *oe;
+  dir_cursor c;
+  int slots, reclaimed, numPending, i;
+
+  *released = 0;
+
+  // count the free slots before the end of the directory
+  slots = 0;
+  dirOpen(&c, dirCluster);
+  while (dirNext(&c) == 0 && c.entry[0] != 0x00)
+    if (c.entry[0] == FREE)
+      slots++;
+  if (slots < threshold)
+    return 0;
+
+  // the write position never passes the read position, entries only move
+  // towards the front
+  writeCluster = dirCluster;
+  writeOffset = clusterOffset(writeCluster);
+  writeEnd = writeOffset + vol->bytesPerCluster;
+  reclaimed = numPending = 0;
+  dirOpen(&c, dirCluster);
+  while (dirNext(&c) == 0 && c.entry[0] != 0x00) {
+    if (c.entry[0] == FREE) {
+      reclaimed += numPending + 1;
+      numPending = 0;
+      continue;
+    }
+
+    // hold long name entries back until their short entry turns up
+    if (c.entry[11] == LONG_DIRECTORY) {
+      if ((c.entry[0] & 0x40) || numPending == 20) {
+        reclaimed += numPending;
+        numPending = 0;
+      }
+      memcpy(&pending[numPending*32], c.entry, 32);
+      pendingOffset[numPending++] = c.offset;
+      continue;
+    }
+    for (i = 0; i < numPending; i++)
+      if ((unsigned char)pending[i*32+13] != lfnChecksum(c.entry))
+        break;
+    if (i < numPending) {
+      reclaimed += numPending;
+      numPending = 0;
+    }
+
+    memcpy(&pending[numPending*32], c.entry, 32);
+    pendingOffset[numPending++] = c.offset;
+    for (i = 0; i < numPending; i++) {
+      if (writeOffset == writeEnd) {
+        writeCluster = getNextCluster(writeCluster) & 0x0FFFFFFF;
+        writeOffset = clusterOffset(writeCluster);
+        writeEnd = writeOffset + vol->bytesPerCluster;
+      }
+      if (writeOffset != pendingOffset[i])
+        writeImage(writeOffset, &pending[i*32], 32);
+      writeOffset += 32;
+    }
+    numPending = 0;
+
+    // open files follow their entry to its new slot
+    if (writeOffset - 32 != c.offset && (oe = findOpenEntry(c.offset)) != NULL)
+      oe->offset = writeOffset - 32;
+  }
+  reclaimed += numPending;
+
+  // the write cluster moves on only to take an entry, so it is the last
+  // one in use; zero the rest of it and give back the clusters after it
+  memset(blank, 0, sizeof(blank));
+  for (; writeOffset < writeEnd; writeOffset += i) {
+    i = vol->bytesPerSector - (writeOffset & (vol->bytesPerSector-1));
+    writeImage(writeOffset, blank, i);
+  }
+  nextCluster = getNextCluster(writeCluster) & 0x0FFFFFFF;
+  if (nextCluster >= 2 && nextCluster < EoC) {
+    setFATEntry(writeCluster, EoC);
+    for (writeCluster = nextCluster; writeCluster >= 2 && writeCluster < EoC;
+         writeCluster = getNextCluster(writeCluster) & 0x0FFFFFFF)
+      (*released)++;
+    clearClusterChain(nextCluster);
+  }
+
+  return reclaimed;
+}
+
+/** resolvePath - walks every component of a path but the last, from the
+                  root for absolute paths and the session's directory
+                  otherwise, and converts the last one to a short name,
+                  which is left empty when the path names a directory only
+ **/
+int resolvePath(session *s, const char *path, unsigned int *dirCluster, char *shortname) {
+  char component[BUFFER_SIZE+1], entry[32];
+  const char *next;
+  unsigned int cluster;
+  off_t offset;
+  int len;
+
+  cluster = path[0] == '/' ? vol->rootCluster : s->currentCluster;
+  shortname[0] = 0;
+
+  while (*path != 0) {
+    // split off the next component
+    while (*path == '/')
+      path++;
+    if (*path == 0)
+      break;
+    next = strchr(path, '/');
+    len = next != NULL ? next - path : strlen(path);
+    if (len > BUFFER_SIZE)
+      return FATEDIT_EINVAL;
+    memcpy(component, path, len);
+    component[len] = 0;
+    path += len;
+    while (*path == '/')
+      path++;
+
+    // last component
+    if (*path == 0) {
+      convertFilename(component);
+      memcpy(shortname, component, 12);
+      break;
+    }
+
+    // the root has no dot entries
+    convertFilename(component);
+    if (cluster == vol->rootCluster && component[0] == '.' &&
+        (component[1] == ' ' || (component[1] == '.' && component[2] == ' ')))
+      continue;
+
+    if (findEntry(cluster, component, entry, &offset) != FATEDIT_OK)
+      return FATEDIT_ENOENT;
+    if (!(entry[11] & SUB_DIRECTORY))
+      return FATEDIT_ENOTDIR;
+    cluster = entryCluster(entry);
+    if (cluster == 0)
+      cluster = vol->rootCluster;
+  }
+
+  *dirCluster = cluster;
+  return FATEDIT_OK;
+}
+
+/** lookupPath - finds the entry a path names, the root directory gets a
+                 made up entry at offset 0
+ **/
+int lookupPath(session *s, const char *path, char *entry, off_t *offset) {
+  char shortname[12];
+  unsigned int dirCluster;
+  int result;
+
+  result = resolvePath(s, path, &dirCluster, shortname);
+  if (result != FATEDIT_OK)
+    return result;
+
+  // the directory itself, or a dot entry of the root
+  if (shortname[0] == 0 ||
+      (dirCluster == vol->rootCluster && (strcmp(shortname, ".          ") == 0 ||
+                                          strcmp(shortname, "..         ") == 0))) {
+    if (shortname[0] == 0 && dirCluster != vol->rootCluster)
+      return findEntry(dirCluster, ".          ", entry, offset);
+    makeDirEntry(entry, "/          ", SUB_DIRECTORY, vol->rootCluster, 0);
+    *offset = 0;
+    return FATEDIT_OK;
+  }
+
+  return findEntry(dirCluster, shortname, entry, offset);
+}
+
+/** tidyDirectory - compacts the directory a removed entry was in once it
+                    has compactThreshold free slots, when that is set
+ **/
+void tidyDirectory(session *s, const char *path) {
+  char shortname[12];
+  unsigned int dirCluster, released;
+
+  if (compactThreshold > 0 && resolvePath(s, path, &dirCluster, shortname) == FATEDIT_OK &&
+      shortname[0] != 0)
+    compactDirectory(dirCluster, compactThreshold, &released);
+}
+
+/** fillStat - describes a directory entry to library callers
+ **/
+void fillStat(char *entry, off_t offset, fatedit_info *st) {
+  open_entry *oe;
+
+  // open files may have newer sizes and times than the disk
+  if (vol->openEntries != NULL && (oe = findOpenEntry(offset)) != NULL)
+    entry = oe->entry;
+
+  memcpy(st->shortname, entry, 11);
+  st->shortname[11] = 0;
+  formatFilename(st->shortname, st->name);
+  st->attr = entry[11];
+  st->firstCluster = entryCluster(entry);
+  memcpy(&st->size, &entry[28], 4);
+  st->id = offset;
+  st->created = decodeTimestamp(&entry[16], &entry[14]);
+  st->modified = decodeTimestamp(&entry[24], &entry[22]);
+  st->accessed = decodeTimestamp(&entry[18], NULL);
+}
+
+/** decodeTimestamp - converts a FAT date and time, kept in local time,
+                      to seconds since the epoch
+ **/
+long long decodeTimestamp(char *date, char *time) {
+  unsigned short fatDate, fatTime;
+  struct tm tm;
+
+  memcpy(&fatDate, date, 2);
+  fatTime = 0;
+  if (time != NULL)
+    memcpy(&fatTime, time, 2);
+  if (fatDate == 0)
+    return 0;
+
+  memset(&tm, 0, sizeof(tm));
+  tm.tm_year = (fatDate >> 9) + 80;
+  tm.tm_mon = ((fatDate >> 5) & 0x0F) - 1;
+  tm.tm_mday = fatDate & 0x1F;
+  tm.tm_hour = fatTime >> 11;
+  tm.tm_min = (fatTime >> 5) & 0x3F;
+  tm.tm_sec = (fatTime & 0x1F) * 2;
+  tm.tm_isdst = -1;
+
+  return mktime(&tm);
+}
+
+/** encodeTimestamp - converts seconds since the epoch to a FAT date and,
+                      when time isn't NULL, a FAT time in local time
+ **/
+void encodeTimestamp(time_t seconds, char *date, char *time) {
+  unsigned short fatDate, fatTime;
+  struct tm tm;
+
+  localtime_r(&seconds, &tm);
+  // FAT dates start in 1980
+  if (tm.tm_year < 80) {
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = 80;
+    tm.tm_mday = 1;
+  }
+  fatDate = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+  fatTime = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+
+  memcpy(date, &fatDate, 2);
+  if (time != NULL)
+    memcpy(time, &fatTime, 2);
+}
+
+/** stampEntry - sets the chosen timestamps of an entry to now
+ **/
+void stampEntry(char *entry, int fields) {
+  time_t now;
+
+  now = time(NULL);
+  if (fields & STAMP_CREATED) {
+    entry[13] = (now % 2) * 100;
+    encodeTimestamp(now, &entry[16], &entry[14]);
+  }
+  if (fields & STAMP_MODIFIED)
+    encodeTimestamp(now, &entry[24], &entry[22]);
+  if (fields & STAMP_ACCESSED)
+    encodeTimestamp(now, &entry[18], NULL);
+}
+
+/** fatedit_open - opens an image, with writes going to a delta file when
+                   an overlay is given, and starts a session in its root
+ **/
+fatedit_volume *fatedit_open(const char *image, const char *overlay, int *error) {
+  return fatedit_open_partition(image, 0, overlay, error);
+}
+
+/** fatedit_open_partition - opens one partition of a disk image like
+                             fatedit_open
+ **/
+fatedit_volume *fatedit_open_partition(const char *image, int partition,
+                                       const char *overlay, int *error) {
+  volume *v;
+  session *s;
+  int result;
+
+  v = openVolume((char*)image, partition, (char*)overlay, &result);
+  if (error != NULL)
+    *error = result;
+  if (v == NULL)
+    return NULL;
+
+  s = openSession(v);
+  s->ownsVolume = 1;
+  return s;
+}
+
+/** fatedit_close - closes every file of a session, then the session, and
+                    the image too when the session opened it
+ **/
+int fatedit_close(fatedit_volume *v) {
+  volume *image;
+  int result, ownsVolume;
+
+  image = v->vol;
+  ownsVolume = v->ownsVolume;
+  // closing the session's files writes their entries back
+  closeSession(v);
+
+  pthread_rwlock_wrlock(&image->lock);
+  vol = image;
+  result = syncVolume() == 0 ? FATEDIT_OK : FATEDIT_EIO;
+  pthread_rwlock_unlock(&image->lock);
+  if (ownsVolume)
+    closeVolume(image);
+
+  return result;
+}
+
+/** fatedit_sync - writes every change made so far back to the image,
+                   including the entries of files still open
+ **/
+int fatedit_sync(fatedit_volume *v) {
+  int result;
+
+  enterSession(v, 1);
+  result = flushOpenEntries() == 0 && syncVolume() == 0 ? FATEDIT_OK : FATEDIT_EIO;
+  leaveSession(v);
+
+  return result;
+}
+
+/** fatedit_fsync - writes every change back like fatedit_sync and waits
+                    for the kernel to make it durable
+ **/
+int fatedit_fsync(fatedit_volume *v, int datasync) {
+  int result, fd;
+
+  enterSession(v, 1);
+  result = flushOpenEntries() == 0 && syncVolume() == 0 ? FATEDIT_OK : FATEDIT_EIO;
+  fd = vol->overlayid >= 0 ? vol->overlayid : vol->imageid;
+  if ((datasync ? fdatasync(fd) : fsync(fd)) != 0)
+    result = FATEDIT_EIO;
+  vol->unsynced = 0;
+  leaveSession(v);
+
+  return result;
+}
+
+/** fatedit_statfs - describes the volume's size and free space from the
+                     counters kept by the allocator
+ **/
+int fatedit_statfs(fatedit_volume *v, fatedit_volinfo *info) {
+  enterSession(v, 0);
+  info->bytesPerCluster = vol->bytesPerCluster;
+  info->totalClusters = vol->numClusters;
+  info->freeClusters = vol->freeClusters;
+  info->nextFree = vol->nextFreeLocation;
+  leaveSession(v);
+
+  return FATEDIT_OK;
+}
+
+/** fatedit_recount - recounts the free clusters from the FAT, returns the
+                      new count
+ **/
+int fatedit_recount(fatedit_volume *v) {
+  int result;
+
+  enterSession(v, 1);
+  result = recountFreeClusters();
+  if (syncVolume() != 0)
+    result = FATEDIT_EIO;
+  leaveSession(v);
+
+  return result;
+}
+
+/** fatedit_overlay_commit - writes the overlay's changes into the image
+                             and empties the overlay
+ **/
+int fatedit_overlay_commit(fatedit_volume *v) {
+  int result;
+
+  enterSession(v, 1);
+  if (vol->overlayid < 0)
+    result = FATEDIT_EINVAL;
+  else if (overlayCommit() != 0 || overlayDiscard() != 0)
+    result = FATEDIT_EIO;
+  else
+    result = FATEDIT_OK;
+  leaveSession(v);
+
+  return result;
+}
+
+/** fatedit_overlay_discard - throws away the overlay's changes, the working
+                              directory goes back to the root since it may
+                              have been one of them
+ **/
+int fatedit_overlay_discard(fatedit_volume *v) {
+  int result;
+
+  enterSession(v, 1);
+  if (vol->overlayid < 0)
+    result = FATEDIT_EINVAL;
+  else if (vol->openEntries != NULL)
+    result = FATEDIT_EBUSY;
+  else if (overlayDiscard() != 0)
+    result = FATEDIT_EIO;
+  else {
+    v->currentCluster = vol->rootCluster;
+    result = FATEDIT_OK;
+  }
+  leaveSession(v);
+
+  return result;
+}
+
+/** fatedit_chdir - changes the session's working directory
+ **/
+int fatedit_chdir(fatedit_volume *v, const char *path) {
+  char entry[32];
+  off_t offset;
+  int result;
+
+  // every thread on the handle resolves relative paths from it
+  enterSession(v, 1);
+  result = lookupPath(v, path, entry, &offset);
+  if (result == FATEDIT_OK && !(entry[11] & SUB_DIRECTORY))
+    result = FATEDIT_ENOTDIR;
+  if (result == FATEDIT_OK) {
+    v->currentCluster = entryCluster(entry);
+    if (v->currentCluster == 0)
+      v->currentCluster = vol->rootCluster;
+  }
+  leaveSession(v);
+
+  return result;
+}
+
+/** fatedit_stat - describes the entry a path names
+ **/
+int fatedit_stat(fatedit_volume *v, const char *path, fatedit_info *st) {
+  char entry[32];
+  off_t offset;
+  int result;
+
+  enterSession(v, 0);
+  result = lookupPath(v, path, entry, &offset);
+  if (result == FATEDIT_OK)
+    fillStat(entry, offset, st);
+  leaveSession(v);
+
+  return result;
+}
+
+/** fatedit_readdir - describes up to max entries of a directory, resuming
+                      after the slot cookie points at, returns the number
+                      of entries filled in; the cookie holds the cluster
+                      and slot so a listing walks the directory once
+ **/
+int fatedit_readdir(fatedit_volume *v, const char *path,
+                    fatedit_info *entries, int max, long long *cookie) {
+  char entry[32];
+  dir_cursor c;
+  unsigned int cluster, slot;
+  off_t offset;
+  int result, count;
+
+  enterSession(v, 0);
+  result = lookupPath(v, path, entry, &offset);
+  if (result == FATEDIT_OK && !(entry[11] & SUB_DIRECTORY))
+    result = FATEDIT_ENOTDIR;
+  if (result != FATEDIT_OK) {
+    leaveSession(v);
+    return result;
+  }
+  cluster = entryCluster(entry);
+  if (cluster == 0)
+    cluster = vol->rootCluster;
+
+  // resume in the cluster the cookie names, past the slots handed out
+  if (*cookie != 0)
+    cluster = *cookie >> 32;
+  dirOpen(&c, cluster);
+  for (slot = *cookie & 0xFFFFFFFF; slot > 0 && dirNext(&c) == 0; slot--);
+
+  count = 0;
+  while (count < max && dirNext(&c) == 0 && c.entry[0] != 0x00) {
+    slot = (c.offset - clusterOffset(c.cluster)) / 32;
+    *cookie = ((long long)c.cluster << 32) | (slot+1);
+    // ignore empty entries, long entry names and the volume label
+    if (c.entry[0] == FREE || c.entry[11] == LONG_DIRECTORY || (c.entry[11] & VOLUME_ID))
+      continue;
+    fillStat(c.entry, c.offset, &entries[count++]);
+  }
+  leaveSession(v);
+
+  return count;
+}
+
+/** fatedit_walk - visits every entry below a directory, handing
+                   subdirectories out to worker threads as they are found;
+                   the workers' cache misses are read side by side, so
+                   their directory reads overlap on the disk
+ **/
+int fatedit_walk(fatedit_volume *v, const char *path, int threads,
+                 fatedit_visit visit, void *arg) {
+  walk_state w;
+  pthread_t *workers;
+  char entry[32], *prefix;
+  unsigned int cluster;
+  off_t offset;
+  int result, i, len;
+
+  enterSession(v, 0);
+  result = lookupPath(v, path, entry, &offset);
+  if (result == FATEDIT_OK && !(entry[11] & SUB_DIRECTORY))
+    result = FATEDIT_ENOTDIR;
+  if (result != FATEDIT_OK) {
+    leaveSession(v);
+    return result;
+  }
+  cluster = entryCluster(entry);
+  if (cluster == 0)
+    cluster = vol->rootCluster;
+
+  // results are reported below path as given, without a trailing slash
+  prefix = strdup(path);
+  for (len = strlen(prefix); len > 1 && prefix[len-1] == '/'; len--)
+    prefix[len-1] = 0;
+
+  memset(&w, 0, sizeof(w));
+  w.vol = vol;
+  w.visit = visit;
+  w.arg = arg;
+  pthread_mutex_init(&w.lock, NULL);
+  pthread_cond_init(&w.cond, NULL);
+  walkPush(&w, cluster, prefix);
+
+  // the calling thread works too
+  if (threads < 1)
+    threads = 1;
+  workers = (pthread_t*)malloc(threads*sizeof(pthread_t));
+  for (i = 1; i < threads; i++)
+    if (pthread_create(&workers[i], NULL, walkWorker, &w) != 0)
+      break;
+  walkWorker(&w);
+  while (--i > 0)
+    pthread_join(workers[i], NULL);
+  free(workers);
+
+  pthread_cond_destroy(&w.cond);
+  pthread_mutex_destroy(&w.lock);
+  leaveSession(v);
+
+  return w.stopped;
+}
+
+/** walkPush - queues a directory for the walk workers, taking over path
+ **/
+void walkPush(walk_state *w, unsigned int cluster, char *path) {
+  walk_item *item;
+
+  item = (walk_item*)malloc(sizeof(walk_item));
+  item->cluster = cluster;
+  item->path = path;
+  item->next = NULL;
+
+  pthread_mutex_lock(&w->lock);
+  if (w->tail != NULL)
+    w->tail->next = item;
+  else
+    w->head = item;
+  w->tail = item;
+  w->pending++;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+}
+
+/** walkWorker - lists queued directories until none are left or being
+                 listed, queueing the subdirectories it finds
+ **/
+void *walkWorker(void *arg) {
+  walk_state *w;
+  walk_item *item;
+  dir_cursor c;
+  fatedit_info info;
+  unsigned int cluster;
+  char *path;
+  int result;
+
+  w = (walk_state*)arg;
+  vol = w->vol;
+  for (;;) {
+    pthread_mutex_lock(&w->lock);
+    while (w->head == NULL && w->pending != 0)
+      pthread_cond_wait(&w->cond, &w->lock);
+    if (w->head == NULL) {
+      pthread_mutex_unlock(&w->lock);
+      return NULL;
+    }
+    item = w->head;
+    w->head = item->next;
+    if (w->head == NULL)
+      w->tail = NULL;
+    pthread_mutex_unlock(&w->lock);
+
+    dirOpen(&c, item->cluster);
+    while (!__atomic_load_n(&w->stopped, __ATOMIC_RELAXED) &&
+           dirNext(&c) == 0 && c.entry[0] != 0x00) {
+      // ignore empty entries, long entry names, the volume label and dots
+      if (c.entry[0] == FREE || c.entry[11] == LONG_DIRECTORY ||
+          (c.entry[11] & VOLUME_ID) || c.entry[0] == '.')
+        continue;
+
+      fillStat(c.entry, c.offset, &info);
+      path = (char*)malloc(strlen(item->path) + strlen(info.name) + 2);
+      sprintf(path, "%s%s%s", item->path,
+              item->path[strlen(item->path)-1] == '/' ? "" : "/", info.name);
+      result = w->visit(path, &info, w->arg);
+      if (result != 0)
+        __atomic_store_n(&w->stopped, result, __ATOMIC_RELAXED);
+
+      cluster = info.firstCluster;
+      if ((info.attr & SUB_DIRECTORY) && cluster >= 2 && cluster != item->cluster)
+        walkPush(w, cluster, path);
+      else
+        free(path);
+    }
+    free(item->path);
+    free(item);
+
+    // wake everyone once the last directory is done
+    pthread_mutex_lock(&w->lock);
+    if (--w->pending == 0)
+      pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+  }
+}
+
+/** fatedit_mkdir - creates a directory with its dot entries
+ **/
+int fatedit_mkdir(fatedit_volume *v, const char *path) {
+  char shortname[12], entry[32], dots[64];
+  unsigned int dirCluster, cluster;
+  off_t offset;
+  int result;
+
+  enterSession(v, 1);
+  result = resolvePath(v, path, &dirCluster, shortname);
+  if (result == FATEDIT_OK &&
+      (shortname[0] == 0 || shortname[0] == '.' ||
+       findEntry(dirCluster, shortname, entry, &offset) == FATEDIT_OK))
+    result = FATEDIT_EEXIST;
+  if (result != FATEDIT_OK) {
+    leaveSession(v);
+    return result;
+  }
+
+  // check for room for new directory entry cluster
+  cluster = newDirectoryCluster();
+  if (cluster == 0) {
+    leaveSession(v);
+    return FATEDIT_ENOSPC;
+  }
+  makeDirEntry(entry, shortname, SUB_DIRECTORY, cluster, 0);
+  stampEntry(entry, STAMP_CREATED | STAMP_MODIFIED | STAMP_ACCESSED);
+  // dot entries carry the directory's own times
+  makeDirEntry(&dots[0], ".          ", SUB_DIRECTORY, cluster, 0);
+  makeDirEntry(&dots[32], "..         ", SUB_DIRECTORY,
+               dirCluster == vol->rootCluster ? 0 : dirCluster, 0);
+  memcpy(&dots[13], &entry[13], 7);
+  memcpy(&dots[45], &entry[13], 7);
+  memcpy(&dots[22], &entry[22], 4);
+  memcpy(&dots[54], &entry[22], 4);
+  writeImage(clusterOffset(cluster), dots, 64);
+
+  // link it into its parent
+  result = addEntry(dirCluster, entry, &offset);
+  if (result != FATEDIT_OK)
+    clearClusterChain(cluster);
+  leaveSession(v);
+
+  return result;
+}
+
+/** fatedit_rmdir - removes an empty directory
+ **/
+int fatedit_rmdir(fatedit_volume *v, const char *path) {
+  char entry[32];
+  dir_cursor c;
+  unsigned int cluster;
+  off_t offset;
+  int result;
+
+  enterSession(v, 1);
+  result = lookupPath(v, path, entry, &offset);
+  if (result == FATEDIT_OK && !(entry[11] & SUB_DIRECTORY))
+    result = FATEDIT_ENOTDIR;
+  // the root and dot entries can't be removed
+  else if (result == FATEDIT_OK && (offset == 0 || entry[0] == '.'))
+    result = FATEDIT_EINVAL;
+  if (result != FATEDIT_OK) {
+    leaveSession(v);
+    return result;
+  }
 
-    // check for more clusters
-    if (i == 64-1 && result == -1) {
-      nextCluster = getNextCluster(currentCluster);
-      if (nextCluster < EoC) {
-        seekTo(firstSectorOfCluster(nextCluster)*bytesPerSector);
-        currentCluster = nextCluster;
-        read(imageid, psector, LCD_SSIZE);
-        i = 0;
-      }
-    }
+  // check for empty directory
+  cluster = entryCluster(entry);
+  dirOpen(&c, cluster);
+  while (result == FATEDIT_OK && dirNext(&c) == 0 && c.entry[0] != 0x00) {
+    if (c.entry[0] != FREE && c.entry[0] != '.' && c.entry[11] != LONG_DIRECTORY)
+      result = FATEDIT_ENOTEMPTY;
   }
-  free(filename);
 
-  seekTo(firstSectorOfCluster(originalCluster)*bytesPerSector);
-  currentCluster = originalCluster;
-  read(imageid, psector, LCD_SSIZE);
+  if (result == FATEDIT_OK) {
+    clearClusterChain(cluster);
+    removeEntry(offset, 0);
+    tidyDirectory(v, path);
+  }
+  leaveSession(v);
 
   return result;
 }
 
-/** fat_write - writes a certain number of bytes of information to the
-                given file starting at the requested location
+/** fatedit_unlink - deletes a file, zeroing its data and entry first when
+                     FATEDIT_ERASE is given
  **/
-int fat_write(char *file_name, unsigned int start_pos, char *quoted_data) {
-  char *filename = (char*)malloc(strlen(file_name)*sizeof(char));
-  int bytesToWrite;
-  char entry_filename[12];
-  entry_filename[11] = 0;
-  unsigned short clusHigh, clusLow;
-  char attrLongName;
-  int result, i, j, nextCluster, originalCluster, entryCluster, openFT_index, final_pos;
-  unsigned int filesize;
-
-  result = -1;
-  strcpy(filename,file_name);
-  convertFilename(filename);
-  originalCluster = currentCluster;
-
-  // navigate through current directory
-  for (i = 0; i < 64 && result == -1; ++i) {
-    memcpy(&entry_filename, &psector[32*i], 11);
-    memcpy(&attrLongName, &psector[11 + 32*i], 1);
-    
-    // no more entries
-    if (entry_filename[0] == 0x00) {
-      result = 1;
-    }
-    // ignore empty entries and long entry names
-    else if (entry_filename[0] != FREE &&
-             attrLongName != LONG_DIRECTORY &&
-             strcmp(entry_filename,filename) == 0) {
-      entryCluster = currentCluster;
-
-      // file is a directory
-      if (attrLongName == SUB_DIRECTORY)
-	      result = 4;
-      // file found
-      else {
-        // get cluster values
-        memcpy(&clusHigh, &psector[20 + 32*i], 2);
-        memcpy(&clusLow, &psector[26 + 32*i], 2);
-
-        // check if file is open already
-        for (j = 0; j < openFT_count && result == -1; j++)
-          // file is open
-          if (openFT[j].firstCluster == combineShorts(clusHigh,clusLow)) {
-            // check for write permissions
-            if (openFT[j].mode != O_WRONLY &&
-                openFT[j].mode != O_RDWR)
-              result = 3;
-            // file is allowed to write
-            else {
-              openFT_index = j;
-              result = 0;
-            }
-          }
-
-        // file is not open
-        if (result == -1)
-          result = 2;
-        // file is open and allowed to write
-        else if (result == 0) {
-          // get file size
-          memcpy(&filesize, &psector[28 + 32*i], 4);
-          // recompute filesize if necessary
-          if ((start_pos+strlen(quoted_data)) > filesize)
-            filesize = start_pos + strlen(quoted_data);
-
-          // load first cluster from file table
-          nextCluster = openFT[openFT_index].firstCluster;
-          // determine if more clusters need to be read until start position
-          while (start_pos >= bytesPerCluster) {
-            nextCluster = getNextCluster(nextCluster);
-            // check for new allocation
-            if (nextCluster >= EoC) {
-              nextCluster = newCluster(currentCluster);
-              // check for out of space
-              if (nextCluster == 0) {
-                seekTo(firstSectorOfCluster(originalCluster)*bytesPerSector);
-                currentCluster = originalCluster;
-                read(imageid, psector, LCD_SSIZE);
-                return 6;
-              }
-            }
-            start_pos -= bytesPerCluster;
-          }
-
-          // go to data section and begin writing from appropriate start position
-          seekTo(firstSectorOfCluster(nextCluster)*bytesPerSector);
-          currentCluster = nextCluster;
-          bytesToWrite = strlen(quoted_data);
-          final_pos = start_pos + bytesToWrite;
-          for (j = 0; j < final_pos; j++) {
-            if (j >= start_pos) {
-              write(imageid,&quoted_data[j-start_pos],1);
-              bytesToWrite--;
-            }
-            else
-              seekTo((firstSectorOfCluster(currentCluster)*bytesPerSector)+(j+1));
-
-            // check for end end of cluster before finished writing
-            if (j == LCD_SSIZE-1 && bytesToWrite) {
-              nextCluster = getNextCluster(currentCluster);
-              // check for EoC
-              if (nextCluster >= EoC)
-                nextCluster = newCluster(currentCluster);
-
-              seekTo(firstSectorOfCluster(nextCluster)*bytesPerSector);
-              currentCluster = nextCluster;
-              j = -1;
-              start_pos = 0;
-            }
-          }
-          // write new file information to directory entry
-          memcpy(&psector[28 + 32*i], &filesize, 4);
-          seekTo(firstSectorOfCluster(entryCluster)*bytesPerSector);
-          write(imageid, psector, LCD_SSIZE);
-        }
-      }
-    }
+int fatedit_unlink(fatedit_volume *v, const char *path, int flags) {
+  open_entry *oe;
+  char entry[32];
+  unsigned int cluster;
+  off_t offset;
+  int result;
 
-    // check for more clusters
-    if (i == 64-1 && result == -1) {
-      nextCluster = getNextCluster(currentCluster);
-      if (nextCluster < EoC) {
-        seekTo(firstSectorOfCluster(nextCluster)*bytesPerSector);
-        currentCluster = nextCluster;
-        read(imageid, psector, LCD_SSIZE);
-        i = 0;
-      }
-    }
+  enterSession(v, 1);
+  result = lookupPath(v, path, entry, &offset);
+  if (result == FATEDIT_OK && (entry[11] & SUB_DIRECTORY))
+    result = FATEDIT_EISDIR;
+  if (result == FATEDIT_OK) {
+    cluster = entryCluster(entry);
+    // check for data removal
+    if (flags & FATEDIT_ERASE)
+      eraseClusterChain(cluster);
+    clearClusterChain(cluster);
+    removeEntry(offset, flags & FATEDIT_ERASE);
+    // handles still open on the file must not write its slot back
+    if ((oe = findOpenEntry(offset)) != NULL)
+      oe->deleted = 1;
+    tidyDirectory(v, path);
   }
-  free(filename);
-
-  seekTo(firstSectorOfCluster(originalCluster)*bytesPerSector);
-  currentCluster = originalCluster;
-  read(imageid, psector, LCD_SSIZE);
+  leaveSession(v);
 
   return result;
 }
 
-/** fat_rm - deletes a file in the current directory
+/** fatedit_rename - moves an entry to another name or directory by
+                     rewriting directory entries only, replacing a file
+                     already there when a file is moved
  **/
-int fat_rm(char *file_name, int clear) {
-  char *filename = (char*)malloc(strlen(file_name)*sizeof(char));
-  char entry_filename[12];
-  entry_filename[11] = 0;
-  unsigned short clusHigh, clusLow;
-  char attrLongName;
-  char zero[1];
-  zero[0] = 0x00;
-  int result, i, j, nextCluster, originalCluster, firstDataCluster, entryCluster;
-
-  result = -1;
-  strcpy(filename,file_name);
-  convertFilename(filename);
-  originalCluster = currentCluster;
-
-  // navigate through current directory
-  for (i = 0; i < 64 && result == -1; ++i) {
-    memcpy(&entry_filename, &psector[32*i], 11);
-    memcpy(&attrLongName, &psector[11 + 32*i], 1);
-
-    // no more entries
-    if (entry_filename[0] == 0x00) {
-      result = 1;
-    }
-    // ignore empty entries and long entry names
-    else if (entry_filename[0] != FREE &&
-        attrLongName != LONG_DIRECTORY &&
-        strcmp(entry_filename,filename) == 0) {
-
-      // file is a directory
-      if (attrLongName == SUB_DIRECTORY)
-	      result = 2;
-      // file found
-      else {
-        // get cluster values
-        memcpy(&clusHigh, &psector[20 + 32*i], 2);
-        memcpy(&clusLow, &psector[26 + 32*i], 2);
-        firstDataCluster = combineShorts(clusHigh,clusLow);
-
-        // delete directory entry properly
-        if (i != 64-1) {
-          memcpy(&entry_filename, &psector[32*(i+1)], 11);
-          if (entry_filename[0] != 0x00) {
-            memcpy(&entry_filename, &psector[32*i], 11);
-            entry_filename[0] = 0xE5;
-          } else {
-            memcpy(&entry_filename, &psector[32*i], 11);
-            entry_filename[0] = 0x00;
-          }
-        }
-        else
-          entry_filename[0] = 0x00;
-
-        // check for data removal
-        if (clear) {
-          entryCluster = currentCluster;
-          seekTo(firstSectorOfCluster(firstDataCluster)*bytesPerSector);
-          currentCluster = firstDataCluster;
-          for (j = 0; j < bytesPerSector*sectorsPerCluster; j++) {
-            write(imageid, zero, 1);
-            if (j == (bytesPerSector*sectorsPerCluster)-1) {
-              nextCluster = getNextCluster(currentCluster);
-              if (nextCluster >= EoC)
-                break;
-              seekTo(firstSectorOfCluster(nextCluster)*bytesPerSector);
-              currentCluster = nextCluster;
-              j = -1;
-            }
-          }
-          seekTo(firstSectorOfCluster(entryCluster)*bytesPerSector);
-          currentCluster = entryCluster;
-        }
-
-        // clear data cluster chain
-        clearClusterChain(firstDataCluster);
+int fatedit_rename(fatedit_volume *v, const char *from, const char *to) {
+  char shortname[12], entry[32], target[32];
+  unsigned int dirCluster, cluster, parent;
+  open_entry *oe;
+  off_t offset, newOffset, targetOffset;
+  dir_cursor c;
+  int result;
 
-        // set directory entry free
-        memcpy(&psector[32*i], &entry_filename, 11);
-        if (clear) {
-          for (j = 1; j < 32; j++)
-            memcpy(&psector[32*i+j], &zero, 1);
-        }
-        seekTo(firstSectorOfCluster(currentCluster)*bytesPerSector);
-        write(imageid, psector, LCD_SSIZE);
+  enterSession(v, 1);
+  result = lookupPath(v, from, entry, &offset);
+  // the root and dot entries stay where they are
+  if (result == FATEDIT_OK && (offset == 0 || entry[0] == '.'))
+    result = FATEDIT_EINVAL;
+  if (result == FATEDIT_OK)
+    result = resolvePath(v, to, &dirCluster, shortname);
+  if (result == FATEDIT_OK && (shortname[0] == 0 || shortname[0] == '.'))
+    result = FATEDIT_EINVAL;
+
+  // a directory can't move below itself
+  cluster = entryCluster(entry);
+  for (parent = dirCluster; result == FATEDIT_OK && (entry[11] & SUB_DIRECTORY) &&
+       parent != vol->rootCluster; parent = entryCluster(target)) {
+    if (parent == cluster)
+      result = FATEDIT_EINVAL;
+    else if (findEntry(parent, "..         ", target, &targetOffset) != FATEDIT_OK ||
+             entryCluster(target) == 0)
+      break;
+  }
 
-        result = 0;
-      }
+  // only a file can take the place of another file
+  if (result == FATEDIT_OK &&
+      findEntry(dirCluster, shortname, target, &targetOffset) == FATEDIT_OK) {
+    if (targetOffset == offset) {
+      leaveSession(v);
+      return FATEDIT_OK;
     }
-
-
-    // check for more clusters
-    if (i == 64-1 && result == -1) {
-      nextCluster = getNextCluster(currentCluster);
-      if (nextCluster < EoC) {
-        seekTo(firstSectorOfCluster(nextCluster)*bytesPerSector);
-        currentCluster = nextCluster; 
-        read(imageid, psector, LCD_SSIZE);
-        i = 0;
-      }
+    if (target[11] & SUB_DIRECTORY)
+      result = FATEDIT_EEXIST;
+    else if (entry[11] & SUB_DIRECTORY)
+      result = FATEDIT_ENOTDIR;
+    else {
+      clearClusterChain(entryCluster(target));
+      removeEntry(targetOffset, 0);
+      if ((oe = findOpenEntry(targetOffset)) != NULL)
+        oe->deleted = 1;
     }
   }
+  if (result != FATEDIT_OK) {
+    leaveSession(v);
+    return result;
+  }
 
-  free(filename);
+  // link the new entry before dropping the old one, so an interrupted
+  // move leaves the file reachable
+  memcpy(entry, shortname, 11);
+  result = addEntry(dirCluster, entry, &newOffset);
+  if (result != FATEDIT_OK) {
+    leaveSession(v);
+    return result;
+  }
+  removeEntry(offset, 0);
+  if ((oe = findOpenEntry(offset)) != NULL) {
+    memcpy(oe->entry, shortname, 11);
+    oe->offset = newOffset;
+  }
 
-  seekTo(firstSectorOfCluster(originalCluster)*bytesPerSector);
-  currentCluster = originalCluster;
-  read(imageid, psector, LCD_SSIZE);
+  // a moved directory's .. follows it to the new parent
+  if ((entry[11] & SUB_DIRECTORY) && cluster != 0) {
+    dirOpen(&c, cluster);
+    if (dirNext(&c) == 0 && dirNext(&c) == 0 && memcmp(c.entry, "..         ", 11) == 0) {
+      memcpy(target, c.entry, 32);
+      setEntryCluster(target, dirCluster == vol->rootCluster ? 0 : dirCluster);
+      writeImage(c.offset, target, 32);
+    }
+  }
+  tidyDirectory(v, from);
+  leaveSession(v);
 
-  return result;
+  return FATEDIT_OK;
 }
 
-/** fat_cd - changes the current working directory to the specified one
+/** fatedit_copy - copies a file to a new one, reserving the whole
+                   destination chain first and moving the data a run of
+                   consecutive clusters at a time
  **/
-int fat_cd(char *dir_name) {
-  char *filename = (char*)malloc(strlen(dir_name)*sizeof(char));
-  char entry_filename[12];
-  entry_filename[11] = 0;
-  unsigned short clusHigh, clusLow;
-  char attrLongName;
-  int result, i, nextCluster, originalCluster;
-
-  result = -1;
-  strcpy(filename,dir_name);
-  convertFilename(filename);
-  originalCluster = currentCluster;
-
-  // navigate through current directory
-  for (i = 0; i < 64 && result == -1; ++i) {
-    memcpy(&entry_filename, &psector[32*i], 11);
-    memcpy(&attrLongName, &psector[11 + 32*i], 1);
-    
-    // no more entries
-    if (entry_filename[0] == 0x00) {
-      result = 1;
-    }
-    // ignore empty entries and long entry names
-    else if (entry_filename[0] != FREE &&
-             attrLongName != LONG_DIRECTORY &&
-             strcmp(entry_filename,filename) == 0) {
-      // file is a directory
-      if (attrLongName == SUB_DIRECTORY) {
-        // get cluster values
-        memcpy(&clusHigh, &psector[20 + 32*i], 2);
-        memcpy(&clusLow, &psector[26 + 32*i], 2);
-
-        // check for next cluster being root
-        nextCluster = combineShorts(clusHigh,clusLow);
-        if (nextCluster == 0)
-          nextCluster = rootCluster;
-
-        // seek to new directory
-        seekTo(firstSectorOfCluster(nextCluster)*bytesPerSector);
-        currentCluster = nextCluster;
-        read(imageid, psector, LCD_SSIZE);
-
-	      result = 0;
+int fatedit_copy(fatedit_volume *v, const char *from, const char *to) {
+  char shortname[12], entry[32], target[32];
+  unsigned int dirCluster, size, count, slack, i, first, last, src, dst, runSrc, runDst, runLength;
+  off_t offset, done, len;
+  int result;
+
+  enterSession(v, 1);
+  result = lookupPath(v, from, entry, &offset);
+  if (result == FATEDIT_OK && (entry[11] & SUB_DIRECTORY))
+    result = FATEDIT_EISDIR;
+  if (result == FATEDIT_OK)
+    result = resolvePath(v, to, &dirCluster, shortname);
+  if (result == FATEDIT_OK && (shortname[0] == 0 || shortname[0] == '.'))
+    result = FATEDIT_EINVAL;
+  if (result == FATEDIT_OK && findEntry(dirCluster, shortname, target, &offset) == FATEDIT_OK)
+    result = FATEDIT_EEXIST;
+  if (result != FATEDIT_OK) {
+    leaveSession(v);
+    return result;
+  }
+
+  // the data is about to be copied over every cluster, so only the slack
+  // after the end of the file gets zeroed
+  memcpy(&size, &entry[28], 4);
+  count = ((unsigned long long)size + vol->bytesPerCluster-1) >> vol->clusterShift;
+  slack = size & (vol->bytesPerCluster-1);
+  if (vol->freeClusters < count) {
+    leaveSession(v);
+    return FATEDIT_ENOSPC;
+  }
+
+  // reserve one contiguous extent so the copy goes in a single run, or a
+  // cluster at a time when the free space is too fragmented for one
+  first = count > 0 ? findFreeRun(count) : 0;
+  if (first != 0) {
+    for (i = 0; i < count; i++)
+      setFATEntry(first + i, i+1 < count ? first + i+1 : EoC);
+    vol->nextFreeLocation = first + i < vol->numClusters+2 ? first + i : 2;
+    if (slack != 0 &&
+        zeroImage(clusterOffset(first + count-1) + slack, vol->bytesPerCluster - slack) != 0)
+      result = FATEDIT_EIO;
+  }
+  else {
+    for (last = 0, i = 0; i < count; i++) {
+      last = newCluster(last, i+1 < count || slack == 0 ? vol->bytesPerCluster : slack);
+      if (last == 0) {
+        clearClusterChain(first);
+        leaveSession(v);
+        return FATEDIT_ENOSPC;
       }
-      // entry is a file
-      else
-        result = 2;
+      if (first == 0)
+        first = last;
     }
+  }
 
-    // check for more clusters
-    if (i == 64-1 && result == -1) {
-      nextCluster = getNextCluster(currentCluster);
-      if (nextCluster < EoC) {
-        seekTo(firstSectorOfCluster(nextCluster)*bytesPerSector);
-        currentCluster = nextCluster;
-        read(imageid, psector, LCD_SSIZE);
-        i = 0;
+  // walk both chains together, copying whenever either stops being
+  // contiguous, and no further than the end of the file
+  done = 0;
+  src = entryCluster(entry);
+  if (count > 0 && (src < 2 || src >= EoC))
+    result = FATEDIT_EIO;
+  dst = first;
+  runSrc = src;
+  runDst = dst;
+  runLength = 0;
+  for (i = 0; i < count && result == FATEDIT_OK; i++) {
+    runLength++;
+    if (i+1 < count) {
+      src = getNextCluster(src) & 0x0FFFFFFF;
+      dst = getNextCluster(dst) & 0x0FFFFFFF;
+      if (src < 2 || src >= EoC) {
+        result = FATEDIT_EIO;
+        break;
       }
+      if (src == runSrc + runLength && dst == runDst + runLength)
+        continue;
     }
+    len = (off_t)runLength << vol->clusterShift;
+    if (len > size - done)
+      len = size - done;
+    if (ioCopy(clusterOffset(runSrc), clusterOffset(runDst), len) != 0)
+      result = FATEDIT_EIO;
+    done += len;
+    runSrc = src;
+    runDst = dst;
+    runLength = 0;
   }
-  free(filename);
 
-  // return to original directory only on error
-  if (result != 0) {
-    seekTo(firstSectorOfCluster(originalCluster)*bytesPerSector);
-    currentCluster = originalCluster;
-    read(imageid, psector, LCD_SSIZE);
+  // the copy is a new file with the source's attributes
+  if (result == FATEDIT_OK) {
+    makeDirEntry(target, shortname, ARCHIVE | (entry[11] & (READ_ONLY | HIDDEN | SYSTEM)),
+                 first, size);
+    stampEntry(target, STAMP_CREATED | STAMP_MODIFIED | STAMP_ACCESSED);
+    result = addEntry(dirCluster, target, &offset);
   }
+  if (result != FATEDIT_OK)
+    clearClusterChain(first);
+  leaveSession(v);
 
   return result;
 }
 
-/** fat_ls - lists the contents of a given directory
+/** fatedit_compact - moves the entries of a directory over the free
+                      slots before them and releases the clusters left
+                      empty, returns the number of slots reclaimed
  **/
-int fat_ls(char *dir_name) {
-  char *filename = (char*)malloc(strlen(dir_name)*sizeof(char));
-  char entry_filename[12];
-  entry_filename[11] = 0;
-  unsigned short clusHigh, clusLow;
-  char attrLongName;
-  int result, i, nextCluster, originalCluster;
-
-  result = -1;
-  strcpy(filename,dir_name);
-  convertFilename(filename);
-  originalCluster = currentCluster;
-
-  // check for root directory
-  if (strcmp(dir_name,".") == 0 &&
-      currentCluster == rootCluster) {
-    for (i = 0; i < 64; ++i) {
-      memcpy(&entry_filename, &psector[32*i], 11);
-      memcpy(&attrLongName, &psector[11 + 32*i], 1);
-
-      // no more entries
-      if (entry_filename[0] == 0x00)
-        break;
-      if (entry_filename[0] != FREE && attrLongName != LONG_DIRECTORY) {
-        removeTailWhitespace(entry_filename);
-	      printf("%s   ", entry_filename);
-      }
-    }
-    printf("\n");
-  }
-  // navigate through current directory
-  else for (i = 0; i < 64 && result == -1; ++i) {
-    memcpy(&entry_filename, &psector[32*i], 11);
-    memcpy(&attrLongName, &psector[11 + 32*i], 1);
-    
-    // no more entries
-    if (entry_filename[0] == 0x00) {
-      result = 1;
-    }
-    // ignore empty entries and long entry names
-    else if (entry_filename[0] != FREE &&
-             attrLongName != LONG_DIRECTORY &&
-             strcmp(entry_filename,filename) == 0) {
-      // found directory
-      if (attrLongName == SUB_DIRECTORY) {
-        memcpy(&clusHigh, &psector[20 + 32*i], 2);
-        memcpy(&clusLow, &psector[26 + 32*i], 2);
-
-        // check for next cluster being root
-        nextCluster = combineShorts(clusHigh,clusLow);
-        if (nextCluster == 0)
-          nextCluster = rootCluster;
-
-        // seek to new directory
-        seekTo(firstSectorOfCluster(nextCluster)*bytesPerSector);
-        currentCluster = nextCluster;
-        read(imageid, psector, LCD_SSIZE);
-
-        // print out entry names in new directory
-        for (i = 0; i < 64; ++i) {
-          memcpy(&entry_filename, &psector[32*i], 11);
-          memcpy(&attrLongName, &psector[11 + 32*i], 1);
-
-          // no more entries
-          if (entry_filename[0] == 0x00)
-            break;
-          if (entry_filename[0] != FREE && attrLongName != LONG_DIRECTORY) {
-            removeTailWhitespace(entry_filename);
-	          printf("%s   ", entry_filename);
-          }
-
-          // check for more clusters
-          if (i == 64-1) {
-            nextCluster = getNextCluster(currentCluster);
-            if (nextCluster < EoC) {
-              seekTo(firstSectorOfCluster(nextCluster)*bytesPerSector);
-              currentCluster = nextCluster;
-              read(imageid, psector, LCD_SSIZE);
-              i = 0;
-            }
-          }
-        }
-        printf("\n");
-	      result = 0;
-      }
-      // entry is a file
-      else
-        result = 2;
-    }
+int fatedit_compact(fatedit_volume *v, const char *path, unsigned int *released) {
+  char entry[32];
+  unsigned int cluster;
+  off_t offset;
+  int result;
 
-    // check for more clusters
-    if (i == 64-1 && result == -1) {
-      nextCluster = getNextCluster(currentCluster);
-      if (nextCluster != EoC) {
-        seekTo(firstSectorOfCluster(nextCluster)*bytesPerSector);
-        currentCluster = nextCluster;
-        read(imageid, psector, LCD_SSIZE);
-        i = 0;
-      }
-    }
+  enterSession(v, 1);
+  result = lookupPath(v, path, entry, &offset);
+  if (result == FATEDIT_OK && !(entry[11] & SUB_DIRECTORY))
+    result = FATEDIT_ENOTDIR;
+  if (result == FATEDIT_OK) {
+    cluster = entryCluster(entry);
+    if (cluster == 0)
+      cluster = vol->rootCluster;
+    result = compactDirectory(cluster, 0, released);
   }
-  free(filename);
-
-  seekTo(firstSectorOfCluster(originalCluster)*bytesPerSector);
-  currentCluster = originalCluster;
-  read(imageid, psector, LCD_SSIZE);
+  leaveSession(v);
 
   return result;
 }
 
-/** fat_mkdir - creates a new directory in the current directory
+/** fatedit_file_open - opens a file, creating or emptying it as flags ask
  **/
-int fat_mkdir(char *dir_name) {
-  char *filename = (char*)malloc(strlen(dir_name)*sizeof(char));
-  char entry_filename[12];
-  entry_filename[11] = 0;
-  unsigned short clusHigh, clusLow;
-  char attrLongName;
-  int result, i, nextCluster, originalCluster, freeEntryIndex, allocatedCluster;
-  unsigned int filesize;
-  char filesize_raw[4];
-  char directory_attribute[1];
-  char short_buffer[2];
-
-  result = freeEntryIndex = -1;
-  strcpy(filename,dir_name);
-  convertFilename(filename);
-  originalCluster = currentCluster;
-  filesize = 0;
-  directory_attribute[0] = SUB_DIRECTORY;
-
-  // navigate through current directory
-  for (i = 0; i < 64 && result == -1; ++i) {
-    memcpy(&entry_filename, &psector[32*i], 11);
-    memcpy(&attrLongName, &psector[11 + 32*i], 1);
-    
-    // set first free entry index for creation
-    if ((entry_filename[0] == FREE || entry_filename[0] == 0x00) &&
-        freeEntryIndex == -1)
-      freeEntryIndex = i;
-
-    // ignore empty entries and long entry names
-    if (entry_filename[0] != FREE &&
-        entry_filename[0] != 0x00 &&
-        attrLongName != LONG_DIRECTORY &&
-        strcmp(entry_filename,filename) == 0) {
-
-      // directory exists already
-      if (attrLongName == SUB_DIRECTORY)
-	      result = 2;
-      // file exists already
-      else
-        result = 1;
-    }
+fatedit_file *fatedit_file_open(fatedit_volume *v, const char *path,
+                                int flags, int *error) {
+  char shortname[12], entry[32];
+  unsigned int dirCluster;
+  fatedit_file *file;
+  off_t offset;
+  int result, mode;
+
+  mode = flags & O_ACCMODE;
+  if (mode != O_RDONLY && mode != O_WRONLY && mode != O_RDWR) {
+    if (error != NULL)
+      *error = FATEDIT_EINVAL;
+    return NULL;
+  }
 
-    // check for more clusters
-    if (i == 64-1 && result == -1) {
-      nextCluster = getNextCluster(currentCluster);
-      if (nextCluster < EoC) {
-        seekTo(firstSectorOfCluster(nextCluster)*bytesPerSector);
-        currentCluster = nextCluster;
-        read(imageid, psector, LCD_SSIZE);
-        i = 0;
-      }
+  // the shared entries of open files change with every open
+  enterSession(v, 1);
+  result = resolvePath(v, path, &dirCluster, shortname);
+  if (result == FATEDIT_OK && (shortname[0] == 0 || shortname[0] == '.'))
+    result = FATEDIT_EISDIR;
+  if (result == FATEDIT_OK) {
+    result = findEntry(dirCluster, shortname, entry, &offset);
+    // create an empty file, its first cluster comes with the first write
+    if (result == FATEDIT_ENOENT && (flags & O_CREAT)) {
+      makeDirEntry(entry, shortname, ARCHIVE, 0, 0);
+      stampEntry(entry, STAMP_CREATED | STAMP_MODIFIED | STAMP_ACCESSED);
+      result = addEntry(dirCluster, entry, &offset);
     }
+    else if (result == FATEDIT_OK && (flags & O_CREAT) && (flags & O_EXCL))
+      result = FATEDIT_EEXIST;
+  }
+  if (result == FATEDIT_OK && (entry[11] & SUB_DIRECTORY))
+    result = FATEDIT_EISDIR;
+  if (result == FATEDIT_OK && (entry[11] & READ_ONLY) && mode != O_RDONLY)
+    result = FATEDIT_EACCES;
+  if (result != FATEDIT_OK) {
+    leaveSession(v);
+    if (error != NULL)
+      *error = result;
+    return NULL;
   }
 
-  // continue if no failures occured
-  if (result == -1) {
-    // check for no more room in current cluster
-    if (freeEntryIndex == -1) {
-      // allocate new cluster
-      nextCluster = newCluster(currentCluster);
-      // check for out of space
-      if (nextCluster == 0) {
-        seekTo(firstSectorOfCluster(originalCluster)*bytesPerSector);
-        currentCluster = originalCluster;
-        read(imageid, psector, LCD_SSIZE);
-        return 3;
-      }
+  file = (fatedit_file*)malloc(sizeof(fatedit_file));
+  file->ses = v;
+  file->oe = holdEntry(offset, entry);
+  file->mode = mode;
+  file->accessed = 0;
+  file->append = (flags & O_APPEND) && mode != O_RDONLY;
+  file->cursor = 0;
+  file->cursorIndex = 0;
+  file->cuts = file->oe->cuts;
+  file->raLast = 0;
+  file->raEnd = 0;
+  v->openFT = (fatedit_file**)realloc(v->openFT, (v->openFT_count+1)*sizeof(fatedit_file*));
+  v->openFT[v->openFT_count++] = file;
+
+  // truncation reaches the disk at once, other handles see it too
+  if ((flags & O_TRUNC) && mode != O_RDONLY) {
+    clearClusterChain(entryCluster(file->oe->entry));
+    setEntryCluster(file->oe->entry, 0);
+    file->oe->tail = 0;
+    file->oe->cuts++;
+    memset(&file->oe->entry[28], 0, 4);
+    stampEntry(file->oe->entry, STAMP_MODIFIED);
+    writeImage(offset, file->oe->entry, 32);
+  }
+  leaveSession(v);
 
-      // go to new cluster
-      seekTo(firstSectorOfCluster(nextCluster)*bytesPerSector);
-      currentCluster = nextCluster;
-      freeEntryIndex = 0;
-    }
+  if (error != NULL)
+    *error = FATEDIT_OK;
+  return file;
+}
 
-    // check for room for new directory entry cluster
-    allocatedCluster = newDirectoryCluster();
-    if (allocatedCluster == 0) {
-      seekTo(firstSectorOfCluster(originalCluster)*bytesPerSector);
-      currentCluster = originalCluster;
-      read(imageid, psector, LCD_SSIZE);
-      return 3;
-    }
+/** fatedit_file_close - closes a file opened through its session, writing
+                         its size and times to its entry
+ **/
+int fatedit_file_close(fatedit_file *f) {
+  session *s;
+  int i;
 
-    // NEW_DIRECTORY
-    // write filename
-    seekTo(firstSectorOfCluster(currentCluster)*bytesPerSector + freeEntryIndex*32);
-    write(imageid, filename, 11);
-    write(imageid, directory_attribute, 1);
-    // write cluster locations
-    clusHigh = allocatedCluster >> 16;
-    clusLow = allocatedCluster & 0xFF;
-    seekTo(firstSectorOfCluster(currentCluster)*bytesPerSector + (20 + freeEntryIndex*32));
-    memcpy(&short_buffer, &clusHigh, 2);
-    write(imageid, short_buffer, 2);
-    seekTo(firstSectorOfCluster(currentCluster)*bytesPerSector + (26 + freeEntryIndex*32));
-    memcpy(&short_buffer, &clusLow, 2);
-    write(imageid, short_buffer, 2);
-    // write filesize
-    memcpy(&filesize_raw, &filesize, 4);
-    write(imageid, filesize_raw, 4);
-
-    free(filename);
-    // NEW_DIRECTORY/.
-    // write filename
-    filename = ".          ";
-    seekTo(firstSectorOfCluster(allocatedCluster)*bytesPerSector);
-    write(imageid, filename, 11);
-    write(imageid, directory_attribute, 1);
-    // write cluster locations
-    clusHigh = allocatedCluster >> 16;
-    clusLow = allocatedCluster & 0xFF;
-    seekTo(firstSectorOfCluster(allocatedCluster)*bytesPerSector + 20);
-    memcpy(&short_buffer, &clusHigh, 2);
-    write(imageid, short_buffer, 2);
-    seekTo(firstSectorOfCluster(allocatedCluster)*bytesPerSector + 26);
-    memcpy(&short_buffer, &clusLow, 2);
-    write(imageid, short_buffer, 2);
-    // write filesize
-    memcpy(&filesize_raw, &filesize, 4);
-    write(imageid, filesize_raw, 4);
-
-    // NEW_DIRECTORY/..
-    // write filename
-    filename = "..         ";
-    seekTo(firstSectorOfCluster(allocatedCluster)*bytesPerSector + 32);
-    write(imageid, filename, 11);
-    write(imageid, directory_attribute, 1);
-    // write cluster locations
-    clusHigh = currentCluster >> 16;
-    clusLow = currentCluster & 0xFF;
-    seekTo(firstSectorOfCluster(allocatedCluster)*bytesPerSector + 20 + 32);
-    memcpy(&short_buffer, &clusHigh, 2);
-    write(imageid, short_buffer, 2);
-    seekTo(firstSectorOfCluster(allocatedCluster)*bytesPerSector + 26 + 32);
-    memcpy(&short_buffer, &clusLow, 2);
-    write(imageid, short_buffer, 2);
-    // write filesize
-    memcpy(&filesize_raw, &filesize, 4);
-    write(imageid, filesize_raw, 4);
-
-    filename = NULL;
-    result = 0;
-  }
-
-  if (filename != NULL)
-    free(filename);
-
-  seekTo(firstSectorOfCluster(originalCluster)*bytesPerSector);
-  currentCluster = originalCluster;
-  read(imageid, psector, LCD_SSIZE);
+  s = f->ses;
+  enterSession(s, 1);
+  for (i = 0; i < s->openFT_count && s->openFT[i] != f; i++);
+  if (i == s->openFT_count) {
+    leaveSession(s);
+    return FATEDIT_EINVAL;
+  }
+  closeFile(f);
+  leaveSession(s);
 
-  return result;
+  return FATEDIT_OK;
 }
 
-/** fat_rmdir - removes the given directory from the current directory
+/** fatedit_fstat - describes an open file
  **/
-int fat_rmdir(char *dir_name) {
-  char *filename = (char*)malloc(strlen(dir_name)*sizeof(char));
-  char entry_filename[12];
-  entry_filename[11] = 0;
-  unsigned short clusHigh, clusLow;
-  char attrLongName;
-  int result, i, j, nextCluster, originalCluster, firstDataCluster;
+int fatedit_fstat(fatedit_file *f, fatedit_info *st) {
+  int result;
 
-  result = -1;
-  strcpy(filename,dir_name);
-  convertFilename(filename);
-  originalCluster = currentCluster;
+  enterSession(f->ses, 0);
+  // the file was deleted while open
+  if (f->oe->deleted)
+    result = FATEDIT_ENOENT;
+  else {
+    fillStat(f->oe->entry, f->oe->offset, st);
+    result = FATEDIT_OK;
+  }
+  leaveSession(f->ses);
 
-  // navigate through current directory
-  for (i = 0; i < 64 && result == -1; ++i) {
-    memcpy(&entry_filename, &psector[32*i], 11);
-    memcpy(&attrLongName, &psector[11 + 32*i], 1);
+  return result;
+}
 
-    // no more entries
-    if (entry_filename[0] == 0x00) {
-      result = 1;
-    }
-    // ignore empty entries and long entry names
-    else if (entry_filename[0] != FREE &&
-        attrLongName != LONG_DIRECTORY &&
-        strcmp(entry_filename,filename) == 0) {
-
-      // directory found
-      if (attrLongName == SUB_DIRECTORY) {
-	      // get cluster values
-        memcpy(&clusHigh, &psector[20 + 32*i], 2);
-        memcpy(&clusLow, &psector[26 + 32*i], 2);
-        firstDataCluster = combineShorts(clusHigh,clusLow);
-
-        // check for empty directory
-        seekTo(firstSectorOfCluster(firstDataCluster)*bytesPerSector);
-        read(imageid, psector, LCD_SSIZE);
-        for (j = 2; j < 64 && result == -1; j++) {
-          memcpy(&entry_filename, &psector[32*j], 11);
-          memcpy(&attrLongName, &psector[11 + 32*j], 1);
-          if (entry_filename[0] == 0x00)
-            break;
-          else if (entry_filename[0] != FREE && attrLongName != LONG_DIRECTORY)
-            result = 3;
-        }
-        seekTo(firstSectorOfCluster(currentCluster)*bytesPerSector);
-        read(imageid, psector, LCD_SSIZE);
-        if (result != -1)
-          break;
+/** fatedit_pread - reads up to len bytes of a file at offset into buf,
+                    returns the number of bytes read, 0 at the end
+ **/
+ssize_t fatedit_pread(fatedit_file *f, void *buf, size_t len, long long offset) {
+  char *entry;
+  unsigned int cluster, filesize, inCluster, chunk, index;
+  size_t done;
+
+  if (f->mode == O_WRONLY)
+    return FATEDIT_EACCES;
+  if (offset < 0)
+    return FATEDIT_EINVAL;
+
+  enterSession(f->ses, 0);
+  // the file was deleted while open
+  if (f->oe->deleted) {
+    leaveSession(f->ses);
+    return FATEDIT_ENOENT;
+  }
+  entry = f->oe->entry;
+  f->accessed = 1;
+  memcpy(&filesize, &entry[28], 4);
+  if (offset >= filesize) {
+    leaveSession(f->ses);
+    return 0;
+  }
+  if (len > filesize - offset)
+    len = filesize - offset;
+
+  // find the cluster holding offset, from where the last read ended or
+  // the tail of the last write when the offset lies past them, so reading
+  // a file in order walks its chain once
+  if (f->cuts != f->oe->cuts) {
+    f->cursor = 0;
+    f->raEnd = 0;
+    f->cuts = f->oe->cuts;
+  }
+  cluster = entryCluster(entry);
+  index = 0;
+  if (f->cursor != 0 && (offset >> vol->clusterShift) >= f->cursorIndex) {
+    cluster = f->cursor;
+    index = f->cursorIndex;
+  }
+  if (f->oe->tail != 0 && (offset >> vol->clusterShift) >= f->oe->tailIndex &&
+      f->oe->tailIndex > index) {
+    cluster = f->oe->tail;
+    index = f->oe->tailIndex;
+  }
+  for (; index < (offset >> vol->clusterShift) && cluster >= 2 && cluster < EoC; index++)
+    cluster = getNextCluster(cluster) & 0x0FFFFFFF;
+  inCluster = offset & (vol->bytesPerCluster-1);
 
-        // delete directory entry properly
-        if (i != 64-1) {
-          memcpy(&entry_filename, &psector[32*(i+1)], 11);
-          if (entry_filename[0] != 0x00) {
-            memcpy(&entry_filename, &psector[32*i], 11);
-            entry_filename[0] = 0xE5;
-          } else {
-            memcpy(&entry_filename, &psector[32*i], 11);
-            entry_filename[0] = 0x00;
-          }
-        }
-        else
-          entry_filename[0] = 0x00;
+  for (done = 0; done < len; done += chunk) {
+    if (cluster < 2 || cluster >= EoC)
+      break;
+    // keep the read-ahead window ahead of the reader, across reads too
+    readAheadFile(f, cluster, index, ((unsigned long long)filesize + vol->bytesPerCluster-1) >>
+                                     vol->clusterShift);
+    chunk = vol->bytesPerCluster - inCluster;
+    if (chunk > len - done)
+      chunk = len - done;
+    readImage(clusterOffset(cluster) + inCluster, (char*)buf + done, chunk);
+    inCluster = 0;
+    f->cursor = cluster;
+    f->cursorIndex = index;
+
+    if (done + chunk < len) {
+      cluster = getNextCluster(cluster) & 0x0FFFFFFF;
+      index++;
+    }
+  }
+  leaveSession(f->ses);
 
-        // clear data cluster chain
-        clearClusterChain(firstDataCluster);
+  return done;
+}
 
-        // set directory entry free
-        memcpy(&psector[32*i], &entry_filename, 11);
-        seekTo(firstSectorOfCluster(currentCluster)*bytesPerSector);
-        write(imageid, psector, LCD_SSIZE);
+/** fatedit_pwrite - writes len bytes of buf to a file at offset, growing
+                     the file and its cluster chain as needed, returns the
+                     number of bytes written
+ **/
+ssize_t fatedit_pwrite(fatedit_file *f, const void *buf, size_t len, long long offset) {
+  char *entry;
+  time_t now;
+  unsigned int cluster, nextCluster, filesize, inCluster, chunk, keep, index;
+  unsigned int gapFrom, gapStart, gapLength;
+  size_t done;
+  int failed;
+
+  if (f->mode == O_RDONLY)
+    return FATEDIT_EACCES;
+  if (offset < 0 || len > 0xFFFFFFFFULL || (!f->append && offset + len > 0xFFFFFFFFULL))
+    return FATEDIT_EINVAL;
+  if (len == 0)
+    return 0;
 
-        result = 0;
-      }
-      // file is not a directory
-      else
-        result = 2;
+  enterSession(f->ses, 1);
+  // the file was deleted while open
+  if (f->oe->deleted) {
+    leaveSession(f->ses);
+    return FATEDIT_ENOENT;
+  }
+  entry = f->oe->entry;
+  memcpy(&filesize, &entry[28], 4);
+
+  // appends land at the end of the file whatever the offset
+  if (f->append) {
+    offset = filesize;
+    if (offset + len > 0xFFFFFFFFULL) {
+      leaveSession(f->ses);
+      return FATEDIT_EINVAL;
     }
+  }
 
+  // clusters the data starts at the front of are only zeroed past its end
+  keep = len < vol->bytesPerCluster ? len : vol->bytesPerCluster;
 
-    // check for more clusters
-    if (i == 64-1 && result == -1) {
-      nextCluster = getNextCluster(currentCluster);
-      if (nextCluster < EoC) {
-        seekTo(firstSectorOfCluster(nextCluster)*bytesPerSector);
-        currentCluster = nextCluster; 
-        read(imageid, psector, LCD_SSIZE);
-        i = 0;
+  // empty files get their first cluster now
+  cluster = entryCluster(entry);
+  if (cluster == 0) {
+    cluster = newCluster(0, offset == 0 ? keep : 0);
+    if (cluster == 0) {
+      leaveSession(f->ses);
+      return FATEDIT_ENOSPC;
+    }
+    setEntryCluster(entry, cluster);
+  }
+
+  // find the cluster holding offset, from the tail when the offset lies
+  // past it, allocating any gap before it
+  done = 0;
+  index = 0;
+  inCluster = offset;
+  if (f->oe->tail != 0 && (offset >> vol->clusterShift) >= f->oe->tailIndex) {
+    cluster = f->oe->tail;
+    index = f->oe->tailIndex;
+    inCluster = offset - ((off_t)index << vol->clusterShift);
+  }
+  // clusters the data doesn't start at the front of are zeroed once the
+  // gap is allocated, a run of consecutive clusters at a time
+  gapFrom = gapStart = gapLength = 0;
+  failed = 0;
+  for (; inCluster >= vol->bytesPerCluster && cluster != 0;
+       inCluster -= vol->bytesPerCluster, index++) {
+    nextCluster = getNextCluster(cluster) & 0x0FFFFFFF;
+    if ((nextCluster < 2 || nextCluster >= EoC) && inCluster == vol->bytesPerCluster)
+      nextCluster = newCluster(cluster, keep);
+    else if (nextCluster < 2 || nextCluster >= EoC) {
+      nextCluster = newCluster(cluster, vol->bytesPerCluster);
+      if (gapFrom == 0)
+        gapFrom = cluster;
+      if (nextCluster != 0 && gapLength > 0 && nextCluster == gapStart + gapLength)
+        gapLength++;
+      else if (nextCluster != 0) {
+        if (gapLength > 0)
+          failed |= ioZero(clusterOffset(gapStart), (off_t)gapLength << vol->clusterShift);
+        gapStart = nextCluster;
+        gapLength = 1;
       }
     }
+    cluster = nextCluster;
   }
+  if (gapLength > 0)
+    failed |= ioZero(clusterOffset(gapStart), (off_t)gapLength << vol->clusterShift);
+
+  // a gap that couldn't be cleared is cut off again
+  if (failed) {
+    nextCluster = getNextCluster(gapFrom) & 0x0FFFFFFF;
+    setFATEntry(gapFrom, EoC);
+    clearClusterChain(nextCluster);
+    leaveSession(f->ses);
+    return FATEDIT_EIO;
+  }
+
+  while (cluster != 0) {
+    chunk = vol->bytesPerCluster - inCluster;
+    if (chunk > len - done)
+      chunk = len - done;
+    writeImage(clusterOffset(cluster) + inCluster, (char*)buf + done, chunk);
+    done += chunk;
+    inCluster = 0;
+    if (index >= f->oe->tailIndex || f->oe->tail == 0) {
+      f->oe->tail = cluster;
+      f->oe->tailIndex = index;
+    }
+    if (done == len)
+      break;
 
-  free(filename);
+    nextCluster = getNextCluster(cluster) & 0x0FFFFFFF;
+    if (nextCluster < 2 || nextCluster >= EoC)
+      nextCluster = newCluster(cluster, len - done < vol->bytesPerCluster ?
+                                        len - done : vol->bytesPerCluster);
+    cluster = nextCluster;
+    index++;
+  }
 
-  seekTo(firstSectorOfCluster(originalCluster)*bytesPerSector);
-  currentCluster = originalCluster;
-  read(imageid, psector, LCD_SSIZE);
+  // the new size and times wait in the shared entry until close or sync
+  if (done != 0 && offset + done > filesize) {
+    filesize = offset + done;
+    memcpy(&entry[28], &filesize, 4);
+  }
+  now = time(NULL);
+  if (done != 0 && now != f->oe->stamped) {
+    stampEntry(entry, STAMP_MODIFIED);
+    f->oe->stamped = now;
+  }
+  entry[11] |= ARCHIVE;
+  f->oe->dirty = 1;
+  leaveSession(f->ses);
 
-  return result;
+  return done != 0 ? (ssize_t)done : FATEDIT_ENOSPC;
 }
 
-/** fat_size - prints out the size of a file in bytes
+/** resizeFile - sets the size of an open file, cutting its chain when
+                 shrink is set and otherwise only growing it, new clusters
+                 come as one zeroed run wherever the volume has room for it
  **/
-int fat_size(char *file_name) {
-  char *filename = (char*)malloc(strlen(file_name)*sizeof(char));
-  char entry_filename[12];
-  char attrLongName;
-  int result, i, nextCluster, originalCluster;
-  unsigned int filesize;
-
-  result = -1;
-  strcpy(filename,file_name);
-  convertFilename(filename);
-  originalCluster = currentCluster;
-
-  // navigate through current directory
-  for (i = 0; i < 64 && result == -1; ++i) {
-    memcpy(&entry_filename, &psector[32*i], 11);
-    memcpy(&attrLongName, &psector[11 + 32*i], 1);
-    
-    // no more entries
-    if (entry_filename[0] == 0x00) {
-      result = 1;
+int resizeFile(open_entry *oe, unsigned int size, int shrink) {
+  char *entry;
+  unsigned int filesize, cluster, last, have, need, start, slack, i;
+
+  entry = oe->entry;
+  memcpy(&filesize, &entry[28], 4);
+  if (size <= filesize && !shrink)
+    return FATEDIT_OK;
+
+  // find the last cluster to keep and the first one past it
+  need = ((unsigned long long)size + vol->bytesPerCluster-1) >> vol->clusterShift;
+  last = 0;
+  for (have = 0, cluster = entryCluster(entry);
+       have < need && cluster >= 2 && cluster < EoC;
+       cluster = getNextCluster(cluster) & 0x0FFFFFFF) {
+    last = cluster;
+    have++;
+  }
+  if (have < need && vol->freeClusters < need - have)
+    return FATEDIT_ENOSPC;
+
+  // whatever lies past the end of the file reads back as zeros once the
+  // file grows over it
+  slack = (size < filesize ? size : filesize) & (vol->bytesPerCluster-1);
+  if (last != 0 && slack != 0 &&
+      zeroImage(clusterOffset(last) + slack, vol->bytesPerCluster - slack) != 0)
+    return FATEDIT_EIO;
+
+  // the tail goes back in one pass, its FAT sectors are written together
+  // on the next flush
+  oe->tail = 0;
+  if (have == need && cluster >= 2 && cluster < EoC) {
+    oe->cuts++;
+    if (last != 0)
+      setFATEntry(last, EoC);
+    else
+      setEntryCluster(entry, 0);
+    clearClusterChain(cluster);
+  }
+
+  // grow by one contiguous extent, or a cluster at a time when the free
+  // space is too fragmented for one
+  else if (have < need) {
+    start = findFreeRun(need - have);
+    if (start != 0) {
+      for (i = 0; i < need - have; i++)
+        setFATEntry(start + i, i+1 < need - have ? start + i+1 : EoC);
+      if (last != 0)
+        setFATEntry(last, start);
+      else
+        setEntryCluster(entry, start);
+      vol->nextFreeLocation = start + i < vol->numClusters+2 ? start + i : 2;
+      if (ioZero(clusterOffset(start), (off_t)(need - have) << vol->clusterShift) != 0)
+        return FATEDIT_EIO;
     }
-    // ignore empty entries and long entry names
-    else if (entry_filename[0] != FREE &&
-             attrLongName != LONG_DIRECTORY &&
-             strcmp(entry_filename,filename) == 0) {
-      // file is a directory
-      if (attrLongName == SUB_DIRECTORY)
-	      result = 2;
-      // file found
-      else {
-        memcpy(&filesize, &psector[28 + 32*i], 4);
-        printf("%d\n",filesize);
-        result = 0;
+    else {
+      for (start = last; have < need; have++) {
+        cluster = newCluster(last, 0);
+        if (cluster == 0)
+          break;
+        last = cluster;
+        if (entryCluster(entry) == 0)
+          setEntryCluster(entry, last);
       }
-    }
 
-    // check for more clusters
-    if (i == 64-1 && result == -1) {
-      nextCluster = getNextCluster(currentCluster);
-      if (nextCluster != EoC) {
-        seekTo(firstSectorOfCluster(nextCluster)*bytesPerSector);
-        currentCluster = nextCluster;
-        read(imageid, psector, LCD_SSIZE);
-        i = 0;
+      // give back what was added when the volume fills up partway
+      if (have < need) {
+        if (start != 0) {
+          cluster = getNextCluster(start) & 0x0FFFFFFF;
+          setFATEntry(start, EoC);
+        }
+        else {
+          cluster = entryCluster(entry);
+          setEntryCluster(entry, 0);
+        }
+        clearClusterChain(cluster);
+        return FATEDIT_ENOSPC;
       }
     }
   }
-  free(filename);
 
-  seekTo(firstSectorOfCluster(originalCluster)*bytesPerSector);
-  currentCluster = originalCluster;
-  read(imageid, psector, LCD_SSIZE);
+  memcpy(&entry[28], &size, 4);
+  stampEntry(entry, STAMP_MODIFIED);
+  oe->stamped = time(NULL);
+  entry[11] |= ARCHIVE;
+  oe->dirty = 1;
 
-  return result;
+  return FATEDIT_OK;
 }
 
-/** seek_to - seeks to the given location
+/** fatedit_ftruncate - cuts or extends an open file to size bytes
  **/
-int seekTo(int location) {
-  return lseek(imageid, location, SEEK_SET);
-}
+int fatedit_ftruncate(fatedit_file *f, long long size) {
+  int result;
 
-/** firstSectorOfCluster - returns the first sector number of
-                           the given cluster index
- **/
-unsigned int firstSectorOfCluster(int n) {
-  return ((n-2) * sectorsPerCluster) + firstDataSector;
+  if (f->mode == O_RDONLY)
+    return FATEDIT_EACCES;
+  if (size < 0 || size > 0xFFFFFFFFLL)
+    return FATEDIT_EINVAL;
+
+  enterSession(f->ses, 1);
+  result = f->oe->deleted ? FATEDIT_ENOENT : resizeFile(f->oe, size, 1);
+  leaveSession(f->ses);
+
+  return result;
 }
 
-/** getNextCluster - returns the FAT value for the next cluster
-                     based on the current cluster
+/** fatedit_fallocate - makes an open file at least size bytes long,
+                        reserving the space as one extent when it can
  **/
-unsigned int getNextCluster(int entryIndex) {
-  int current_pos, FATLoc, indexLoc;
-  unsigned int FATValue;
-  char rawFATValue[4];
-
-  // set FAT location
-  FATLoc = reservedSectorCount * bytesPerSector;
-  // determine requested index location
-  indexLoc = FATLoc + (entryIndex * 4);
-  // get current position
-  current_pos = lseek(imageid,0,SEEK_CUR);
+int fatedit_fallocate(fatedit_file *f, long long size) {
+  int result;
 
-  // move to first FAT index
-  seekTo(indexLoc);
+  if (f->mode == O_RDONLY)
+    return FATEDIT_EACCES;
+  if (size < 0 || size > 0xFFFFFFFFLL)
+    return FATEDIT_EINVAL;
 
-  // read information
-  read(imageid,rawFATValue,4);
-  memcpy(&FATValue,&rawFATValue,4);
+  enterSession(f->ses, 1);
+  result = f->oe->deleted ? FATEDIT_ENOENT : resizeFile(f->oe, size, 0);
+  leaveSession(f->ses);
 
-  // return to original position
-  seekTo(current_pos);
-  
-  return FATValue;
+  return result;
 }
 
-/** combineShorts - combines two shorts into a long properly
+/** fatedit_strerror - describes an error code
  **/
-unsigned int combineShorts(unsigned short high, unsigned short low) {
-  return ((high<<16) | low);
+const char *fatedit_strerror(int error) {
+  switch (error) {
+    case FATEDIT_OK: return "Success";
+    case FATEDIT_ENOENT: return "No such file or directory";
+    case FATEDIT_EEXIST: return "File exists";
+    case FATEDIT_ENOTDIR: return "Not a directory";
+    case FATEDIT_EISDIR: return "Is a directory";
+    case FATEDIT_ENOTEMPTY: return "Directory not empty";
+    case FATEDIT_ENOSPC: return "FAT32 volume ran out of space";
+    case FATEDIT_EACCES: return "Permission denied";
+    case FATEDIT_EINVAL: return "Invalid argument";
+    case FATEDIT_EIO: return "Input/output error";
+    case FATEDIT_EBADIMG: return "Not a FAT32 image";
+    case FATEDIT_EOVERLAY: return "Unable to use overlay";
+    case FATEDIT_EBUSY: return "Files are still open";
+    default: return "Unknown error";
+  }
 }
 
-/** newCluster - allocates a new cluster and updates the FATs accordingly
+/** fat_daemon - keeps images open and serves commands sent by clients
+                 over a UNIX socket until interrupted, each client on its
+                 own thread
  **/
-unsigned int newCluster(unsigned int linkedCluster) {
-  int current_pos, FATLoc, i, j;
-  unsigned int FATValue;
-  unsigned int EoC_value = EoC;
-  char rawFATValue[4];
-  char blank_data[sectorsPerCluster*bytesPerSector];
-  int freeLocation, linkedClusterIndex;
-
-  freeLocation = linkedClusterIndex = 0;
+int fat_daemon(char *socket_path) {
+  struct sockaddr_un addr;
+  struct sigaction action;
+  sigset_t stopSignals, oldMask;
+  daemon_client *client;
+  pthread_t thread;
+  int listenid, fd, i;
+
+  // listen on a fresh socket
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(out, "fat-edit: daemon: Socket path is too long.\n");
+    return 1;
+  }
+  strcpy(addr.sun_path, socket_path);
+  unlink(socket_path);
+  listenid = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listenid < 0 ||
+      bind(listenid, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(listenid, DAEMON_BACKLOG) != 0) {
+    fprintf(out, "fat-edit: daemon: Unable to listen on %s.\n", socket_path);
+    return 1;
+  }
 
-  // set FAT location
-  FATLoc = reservedSectorCount * bytesPerSector;
-  // get current position
-  current_pos = lseek(imageid,0,SEEK_CUR);
-
-  // move to first FAT index
-  seekTo(FATLoc);
-
-  for (i = 0; i < (sizeFAT*bytesPerSector)/4; i++) {
-    // read information
-    read(imageid,rawFATValue,4);
-    memcpy(&FATValue,&rawFATValue,4);
-
-    // check for first free block
-    if (FATValue == 0x00000000 && freeLocation == 0)
-      freeLocation = i;
-    // find next free location
-    else if (FATValue == 0x00000000 && freeLocation != 0)
-      nextFreeLocation = i;
-    // check for linkedCluster indeex
-    else if (FATValue == linkedCluster)
-      linkedClusterIndex = i;
-    // check for no free space
-    else if (i == ((sizeFAT*bytesPerSector)/4)-1) {
-      // return to original position
-      seekTo(current_pos);
-      return 0;
+  // stop signals interrupt accept instead of restarting it
+  signal(SIGPIPE, SIG_IGN);
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = daemonStop;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  sigemptyset(&stopSignals);
+  sigaddset(&stopSignals, SIGINT);
+  sigaddset(&stopSignals, SIGTERM);
+  daemon_alive = 1;
+
+  fprintf(out, "fat-edit: daemon: Serving on %s.\n", socket_path);
+  fflush(out);
+
+  while (daemon_alive) {
+    fd = accept(listenid, NULL, NULL);
+    if (fd < 0)
+      continue;
+
+    client = (daemon_client*)calloc(1, sizeof(daemon_client));
+    client->fd = fd;
+
+    // workers leave the stop signals to this thread
+    pthread_sigmask(SIG_BLOCK, &stopSignals, &oldMask);
+    if (pthread_create(&thread, NULL, serveClient, client) != 0) {
+      close(fd);
+      free(client);
     }
+    else
+      pthread_detach(thread);
+    pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
   }
 
-  // update all FAT tables
-  for (j = 0; j < numFATs; j++) {
-    // update new block to EoC value
-    seekTo(FATLoc+(j*sizeFAT*bytesPerSector)+(freeLocation*((sizeFAT*bytesPerSector)/4)));
-    memcpy(&rawFATValue,&EoC_value,4);
-    write(imageid,&rawFATValue,4);
-    // update linkedCluster FAT entry to new free block location
-    seekTo(FATLoc+(linkedClusterIndex*4));
-    memcpy(&rawFATValue,&freeLocation,4);
-    write(imageid,&rawFATValue,4);
-  }
-
-  // clear out data in cluster
-  seekTo(firstSectorOfCluster(freeLocation)*bytesPerSector);
-  write(imageid, &blank_data, sectorsPerCluster*bytesPerSector);
-
-  // return to original position
-  seekTo(current_pos);
-  
-  return freeLocation;
+  // wait out running commands and write back every volume before going away
+  pthread_mutex_lock(&volumesLock);
+  for (i = 0; i < numVolumes; i++) {
+    vol = volumes[i];
+    pthread_rwlock_wrlock(&vol->lock);
+    flushOpenEntries();
+    syncVolume();
+    close(vol->imageid);
+  }
+  close(listenid);
+  unlink(socket_path);
+
+  return 0;
 }
 
-/** newDirectoryCluster - allocates a new directory cluster and updates
-                          the FATs accordingly
+/** fat_remote - sends each command line read from stdin to a daemon and
+                 prints the output it returns
  **/
-unsigned int newDirectoryCluster() {
-  int current_pos, FATLoc, i, j;
-  unsigned int FATValue;
-  unsigned int EoC_value = EoC;
-  char rawFATValue[4];
-  int freeLocation;
+int fat_remote(char *socket_path, char *image, int partition) {
+  struct sockaddr_un addr;
+  char line[BUFFER_SIZE+1];
+  char *path, *request, *output;
+  unsigned int header[3];
+  int sockid, i;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path)-1);
+  sockid = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sockid < 0 || connect(sockid, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    fprintf(out, "fat-edit: Unable to connect to %s.\n", socket_path);
+    return 1;
+  }
 
-  freeLocation = 0;
+  // the daemon resolves paths from its own working directory
+  path = realpath(image, NULL);
+  if (path == NULL)
+    path = strdup(image);
+  request = (char*)malloc(12 + strlen(path) + BUFFER_SIZE);
+
+  while (fgets(line, BUFFER_SIZE, stdin) != NULL) {
+    for (i = 0; line[i] != 0; i++)
+      if (line[i] == '\n' || line[i] == '\r')
+        line[i] = 0;
+
+    // request is both lengths, the partition, the image path and the
+    // command line
+    header[0] = strlen(path);
+    header[1] = strlen(line);
+    header[2] = partition;
+    memcpy(request, header, 12);
+    memcpy(request + 12, path, header[0]);
+    memcpy(request + 12 + header[0], line, header[1]);
+    if (sendAll(sockid, request, 12 + header[0] + header[1]) != 0)
+      break;
 
-  // set FAT location
-  FATLoc = reservedSectorCount * bytesPerSector;
-  // get current position
-  current_pos = lseek(imageid,0,SEEK_CUR);
-
-  // move to first FAT index
-  seekTo(FATLoc);
-
-  for (i = nextFreeLocation; i < (sizeFAT*bytesPerSector)/4; i++) {
-    // read information
-    read(imageid,rawFATValue,4);
-    memcpy(&FATValue,&rawFATValue,4);
-
-    // check for first free block
-    if (FATValue == 0x00000000 && freeLocation == 0)
-      freeLocation = i;
-    // find next free location
-    else if (FATValue == 0x00000000 && freeLocation != 0) {
-      nextFreeLocation = i;
+    // response is a status, the output length and the output
+    if (recvAll(sockid, (char*)header, 8) != 0)
+      break;
+    output = (char*)malloc(header[1]);
+    if (recvAll(sockid, output, header[1]) != 0) {
+      free(output);
       break;
     }
-    // check for no free space
-    else if (i == ((sizeFAT*bytesPerSector)/4)-1) {
-      // return to original position
-      seekTo(current_pos);
-      return 0;
+    fwrite(output, 1, header[1], stdout);
+    free(output);
+
+    if (strcmp(line, "exit") == 0)
+      break;
+  }
+
+  free(request);
+  free(path);
+  close(sockid);
+
+  return 0;
+}
+
+/** findVolume - returns the open volume for an image path and partition,
+                 opening the image on first use
+ **/
+volume *findVolume(char *path, int partition) {
+  char *canonical;
+  volume *v;
+  int i, error;
+
+  canonical = realpath(path, NULL);
+  if (canonical == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&volumesLock);
+  for (i = 0; i < numVolumes; i++) {
+    if (strcmp(volumes[i]->imagename, canonical) == 0 &&
+        volumes[i]->partition == partition) {
+      v = volumes[i];
+      pthread_mutex_unlock(&volumesLock);
+      free(canonical);
+      return v;
     }
   }
 
-  // update all FAT tables
-  for (j = 0; j < numFATs; j++) {
-    // update new block to EoC value
-    seekTo(FATLoc+(j*sizeFAT*bytesPerSector)+(freeLocation*((sizeFAT*bytesPerSector)/4)));
-    memcpy(&rawFATValue,&EoC_value,4);
-    write(imageid,&rawFATValue,4);
+  v = openVolume(canonical, partition, NULL, &error);
+  if (v != NULL) {
+    volumes = (volume**)realloc(volumes, (numVolumes+1)*sizeof(volume*));
+    volumes[numVolumes++] = v;
   }
+  pthread_mutex_unlock(&volumesLock);
+  free(canonical);
 
-  // return to original position
-  seekTo(current_pos);
-  
-  return freeLocation;
+  return v;
 }
 
-/** clearClusterChain - clears out a cluster chain
+/** runCommand - executes one command line in the current session and
+                 returns everything it printed in a malloc'd buffer
  **/
-void clearClusterChain(unsigned int startCluster) {
-  int FATLoc, j;
-  unsigned int EMPTY_value = EMPTY;
-  unsigned int nextCluster;
-  char rawFATValue[4];
+char *runCommand(char *line, size_t *len) {
+  FILE *console;
+  char *output;
+
+  clear_buffer();
+  buffer = (char*)arenaAlloc(BUFFER_SIZE+1);
+  strncpy(buffer, line, BUFFER_SIZE-1);
+  buffer[BUFFER_SIZE-1] = 0;
+
+  // capture the command's output instead of printing it
+  console = out;
+  out = open_memstream(&output, len);
+
+  parse_input();
+  if (command != NULL) {
+    execute();
+    finishCommand();
+  }
 
-  // end of cluster chain
-  if (startCluster >= EoC)
-    return;
+  fclose(out);
+  out = console;
 
-  // call recursively
-  nextCluster = getNextCluster(startCluster);
-  clearClusterChain(nextCluster);
+  return output;
+}
 
-  // set FAT location
-  FATLoc = reservedSectorCount * bytesPerSector;
+/** serveClient - answers one client's requests until it disconnects or
+                  sends exit
+ **/
+void *serveClient(void *arg) {
+  daemon_client *client;
+  int i;
 
-  // update all FAT tables
-  for (j = 0; j < numFATs; j++) {
-    // update new block to empty value
-    seekTo(FATLoc+(j*sizeFAT*bytesPerSector)+(startCluster*((sizeFAT*bytesPerSector)/4)));
-    memcpy(&rawFATValue,&EMPTY_value,4);
-    write(imageid,&rawFATValue,4);
-  }
+  client = (daemon_client*)arg;
+  stay_alive = 1;
+  while (handleRequest(client) == 0);
+
+  close(client->fd);
+  for (i = 0; i < client->numSessions; i++)
+    closeSession(client->sessions[i]);
+  free(client->sessions);
+  free(client);
 
-  // go back to original position
-  seekTo(firstSectorOfCluster(currentCluster)*bytesPerSector);
+  return NULL;
 }
 
-/** convertFilename - converts a filename to a proper short filename
+/** handleRequest - reads one request from a client and answers it,
+                    returns nonzero when the client should be disconnected
  **/
-void convertFilename(char *filename) {
-  // check for dot entries
-  int i, j;
-  char *temp;
-  int dot_entry = 0;
-  if (strcmp(filename,".") == 0) {
-    temp = ".          ";
-    dot_entry = 1;
-  } else if (strcmp(filename,"..") == 0) {
-    temp = "..         ";
-    dot_entry = 1;
+int handleRequest(daemon_client *client) {
+  unsigned int header[3];
+  char *image, *line, *output;
+  size_t len;
+  volume *v;
+  int i, done;
+
+  // request is both lengths, the partition, the image path and the
+  // command line
+  if (recvAll(client->fd, (char*)header, 12) != 0 ||
+      header[0] > DAEMON_MAX_REQUEST || header[1] > DAEMON_MAX_REQUEST - header[0])
+    return 1;
+  image = (char*)calloc(header[0]+1, sizeof(char));
+  line = (char*)calloc(header[1]+1, sizeof(char));
+  if (recvAll(client->fd, image, header[0]) != 0 ||
+      recvAll(client->fd, line, header[1]) != 0) {
+    free(image);
+    free(line);
+    return 1;
   }
-  if (dot_entry) {
-    strcpy(filename,temp);
-    return;
+
+  // run the command in the client's session on the requested image
+  v = findVolume(image, header[2]);
+  if (v == NULL) {
+    header[0] = 1;
+    len = asprintf(&output, "fat-edit: Unable to open %s as a FAT32 image.\n", image);
+  }
+  else {
+    for (i = 0; i < client->numSessions && client->sessions[i]->vol != v; i++);
+    if (i == client->numSessions) {
+      client->sessions = (session**)realloc(client->sessions,
+                                            (client->numSessions+1)*sizeof(session*));
+      client->sessions[client->numSessions++] = openSession(v);
+    }
+    vol = v;
+    ses = client->sessions[i];
+    header[0] = 0;
+    output = runCommand(line, &len);
   }
+  header[1] = len;
 
-  // otherwise convert normally
-  char *old_filename = (char*)malloc(strlen(filename)*sizeof(char));
-  strcpy(old_filename,filename);
+  done = sendAll(client->fd, (char*)header, 8) != 0 ||
+         sendAll(client->fd, output, len) != 0;
+  free(output);
+  free(image);
+  free(line);
 
-  free(filename);
-  filename = (char*)malloc(12*sizeof(char));
-  filename[11] = 0;
+  // exit ends the client's session, not the daemon
+  if (!stay_alive)
+    done = 1;
 
-  for (i = 0; i < 11; i++) {
-    if (old_filename[i] == '.') {
-      for (j = i; j < 11; j++) {
-        if (j < 8)
-          filename[j] = ' ';
-        else {
-          i++;
-          if (old_filename[i] == 0)
-            filename[j] = ' ';
-          else
-            filename[j] = toupper(old_filename[i]);
-        }
-      }
-      i = 12;
-    } else if (old_filename[i] == 0)
-      filename[i] = ' ';
-    else
-      filename[i] = toupper(old_filename[i]);
+  return done;
+}
+
+/** sendAll - writes a whole buffer to a socket
+ **/
+int sendAll(int fd, char *data, size_t len) {
+  ssize_t sent;
+
+  while (len > 0) {
+    sent = send(fd, data, len, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent <= 0)
+      return 1;
+    data += sent;
+    len -= sent;
   }
 
-  free(old_filename);
+  return 0;
 }
 
-/** removeTailWhitespace - removes trailing whitespace in FAT32 short filenames
+/** recvAll - reads exactly len bytes from a socket
  **/
-void removeTailWhitespace(char *filename) {
-  int i;
-  for (i = strlen(filename)-1; i >= 0 && filename[i] == ' '; i--) {
-    filename[i] = 0;
+int recvAll(int fd, char *data, size_t len) {
+  ssize_t got;
+
+  while (len > 0) {
+    got = recv(fd, data, len, 0);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return 1;
+    data += got;
+    len -= got;
   }
+
+  return 0;
+}
+
+/** daemonStop - signal handler that lets the daemon shut down cleanly
+ **/
+void daemonStop(int sig) {
+  daemon_alive = 0;
 }
@@ -0,0 +1,416 @@
+/***
+ * File: fat-fuse.c
+ * Mounts a FAT32 image through libfatedit with FUSE
+ ***/
+
+#define FUSE_USE_VERSION 31
+#define _GNU_SOURCE
+#include <fuse.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "libfatedit.h"
+
+#define READDIR_BATCH 64
+
+// an open file, fuse may call on one file from several threads at once
+// while a library file handle is used by one thread at a time
+typedef struct {
+  fatedit_file *file;
+  pthread_mutex_t lock;
+} fatfuse_file;
+
+/*** FUNCTION PROTOTYPES ***/
+int fuseError(int error);
+void fillAttr(fatedit_info *info, struct stat *st);
+fatfuse_file *openFile(const char *path, int flags, int *error);
+
+void *fatfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg);
+void fatfs_destroy(void *data);
+int fatfs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi);
+int fatfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                  off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags);
+int fatfs_open(const char *path, struct fuse_file_info *fi);
+int fatfs_create(const char *path, mode_t mode, struct fuse_file_info *fi);
+int fatfs_release(const char *path, struct fuse_file_info *fi);
+int fatfs_read(const char *path, char *buf, size_t size, off_t offset,
+               struct fuse_file_info *fi);
+int fatfs_write(const char *path, const char *buf, size_t size, off_t offset,
+                struct fuse_file_info *fi);
+int fatfs_truncate(const char *path, off_t size, struct fuse_file_info *fi);
+int fatfs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                    struct fuse_file_info *fi);
+int fatfs_mkdir(const char *path, mode_t mode);
+int fatfs_unlink(const char *path);
+int fatfs_rmdir(const char *path);
+int fatfs_rename(const char *from, const char *to, unsigned int flags);
+int fatfs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+int fatfs_statfs(const char *path, struct statvfs *st);
+
+/*** GLOBAL VARIABLES ***/
+// the library locks the image itself, shared for reads and exclusively
+// for changes, so fuse threads call on the volume handle directly
+fatedit_volume *mounted;
+
+struct fatfuse_options {
+  char *image;
+  char *overlay;
+  int partition;
+} options;
+
+const struct fuse_opt optionSpec[] = {
+  {"image=%s", offsetof(struct fatfuse_options, image), 1},
+  {"overlay=%s", offsetof(struct fatfuse_options, overlay), 1},
+  {"partition=%d", offsetof(struct fatfuse_options, partition), 1},
+  FUSE_OPT_END
+};
+
+const struct fuse_operations operations = {
+  .init = fatfs_init,
+  .destroy = fatfs_destroy,
+  .getattr = fatfs_getattr,
+  .readdir = fatfs_readdir,
+  .open = fatfs_open,
+  .create = fatfs_create,
+  .release = fatfs_release,
+  .read = fatfs_read,
+  .write = fatfs_write,
+  .truncate = fatfs_truncate,
+  .fallocate = fatfs_fallocate,
+  .mkdir = fatfs_mkdir,
+  .unlink = fatfs_unlink,
+  .rmdir = fatfs_rmdir,
+  .rename = fatfs_rename,
+  .fsync = fatfs_fsync,
+  .statfs = fatfs_statfs,
+};
+
+/*** MAIN FUNCTION ***/
+int main(int argc, char **argv) {
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  int error, result;
+
+  // parse options
+  if (fuse_opt_parse(&args, &options, optionSpec, NULL) == -1)
+    return 1;
+  if (options.image == NULL) {
+    fprintf(stderr, "USAGE: fat-fuse -o image=<FAT32 image>[,overlay=<delta>][,partition=<n>] <mountpoint>\n");
+    return 1;
+  }
+
+  // open the image before mounting so errors reach the terminal
+  mounted = fatedit_open_partition(options.image, options.partition, options.overlay, &error);
+  if (mounted == NULL) {
+    fprintf(stderr, "fat-fuse: %s: %s.\n", options.image, fatedit_strerror(error));
+    return 1;
+  }
+
+  result = fuse_main(args.argc, args.argv, &operations, NULL);
+  fuse_opt_free_args(&args);
+
+  return result;
+}
+
+/** fuseError - maps a libfatedit error code to a negated errno
+ **/
+int fuseError(int error) {
+  switch (error) {
+    case FATEDIT_OK: return 0;
+    case FATEDIT_ENOENT: return -ENOENT;
+    case FATEDIT_EEXIST: return -EEXIST;
+    case FATEDIT_ENOTDIR: return -ENOTDIR;
+    case FATEDIT_EISDIR: return -EISDIR;
+    case FATEDIT_ENOTEMPTY: return -ENOTEMPTY;
+    case FATEDIT_ENOSPC: return -ENOSPC;
+    case FATEDIT_EACCES: return -EACCES;
+    case FATEDIT_EINVAL: return -EINVAL;
+    case FATEDIT_EBUSY: return -EBUSY;
+    default: return -EIO;
+  }
+}
+
+/** fillAttr - describes a directory entry as a stat structure
+ **/
+void fillAttr(fatedit_info *info, struct stat *st) {
+  memset(st, 0, sizeof(struct stat));
+  if (info->attr & FATEDIT_ATTR_DIRECTORY) {
+    st->st_mode = S_IFDIR | 0755;
+    st->st_nlink = 2;
+  }
+  else {
+    st->st_mode = S_IFREG | ((info->attr & FATEDIT_ATTR_READ_ONLY) ? 0444 : 0644);
+    st->st_nlink = 1;
+  }
+  st->st_uid = getuid();
+  st->st_gid = getgid();
+  st->st_size = info->size;
+  st->st_blocks = (info->size + 511) / 512;
+}
+
+/** openFile - opens a file through the library and wraps it with its lock,
+               returns NULL and sets error on failure
+ **/
+fatfuse_file *openFile(const char *path, int flags, int *error) {
+  fatfuse_file *handle;
+  fatedit_file *file;
+
+  file = fatedit_file_open(mounted, path, flags, error);
+  if (file == NULL)
+    return NULL;
+
+  handle = (fatfuse_file*)malloc(sizeof(fatfuse_file));
+  handle->file = file;
+  pthread_mutex_init(&handle->lock, NULL);
+
+  return handle;
+}
+
+/** fatfs_init - lets the kernel keep file pages between opens, the image
+                 only changes through this mount
+ **/
+void *fatfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+  cfg->use_ino = 0;
+  cfg->kernel_cache = 1;
+  return NULL;
+}
+
+/** fatfs_destroy - writes everything back and closes the image on unmount
+ **/
+void fatfs_destroy(void *data) {
+  fatedit_close(mounted);
+  mounted = NULL;
+}
+
+/** fatfs_getattr - describes a file or directory
+ **/
+int fatfs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+  fatfuse_file *handle;
+  fatedit_info info;
+  int result;
+
+  if (fi != NULL) {
+    handle = (fatfuse_file*)(uintptr_t)fi->fh;
+    pthread_mutex_lock(&handle->lock);
+    result = fatedit_fstat(handle->file, &info);
+    pthread_mutex_unlock(&handle->lock);
+  }
+  else
+    result = fatedit_stat(mounted, path, &info);
+
+  if (result == FATEDIT_OK)
+    fillAttr(&info, st);
+  return fuseError(result);
+}
+
+/** fatfs_readdir - lists a directory, a batch of entries at a time
+ **/
+int fatfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                  off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+  fatedit_info entries[READDIR_BATCH];
+  struct stat st;
+  long long cookie;
+  int count, i;
+
+  // the root has no dot entries of its own
+  if (strcmp(path, "/") == 0) {
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+  }
+
+  cookie = 0;
+  do {
+    count = fatedit_readdir(mounted, path, entries, READDIR_BATCH, &cookie);
+    for (i = 0; i < count; i++) {
+      fillAttr(&entries[i], &st);
+      filler(buf, entries[i].name, &st, 0, 0);
+    }
+  } while (count > 0);
+
+  return count < 0 ? fuseError(count) : 0;
+}
+
+/** fatfs_open - opens a file, keeping the library handle in fi->fh
+ **/
+int fatfs_open(const char *path, struct fuse_file_info *fi) {
+  fatfuse_file *handle;
+  int error;
+
+  handle = openFile(path, fi->flags & (O_ACCMODE | O_TRUNC), &error);
+
+  fi->fh = (uint64_t)(uintptr_t)handle;
+  return fuseError(error);
+}
+
+/** fatfs_create - creates and opens a file, the mode has no FAT32 meaning
+ **/
+int fatfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+  fatfuse_file *handle;
+  int error;
+
+  handle = openFile(path, (fi->flags & (O_ACCMODE | O_EXCL | O_TRUNC)) | O_CREAT, &error);
+
+  fi->fh = (uint64_t)(uintptr_t)handle;
+  return fuseError(error);
+}
+
+/** fatfs_release - closes a file once the kernel drops its last reference
+ **/
+int fatfs_release(const char *path, struct fuse_file_info *fi) {
+  fatfuse_file *handle;
+  int result;
+
+  handle = (fatfuse_file*)(uintptr_t)fi->fh;
+  result = fatedit_file_close(handle->file);
+  pthread_mutex_destroy(&handle->lock);
+  free(handle);
+
+  return fuseError(result);
+}
+
+/** fatfs_read - reads from an open file, reads of different files run
+                 side by side
+ **/
+int fatfs_read(const char *path, char *buf, size_t size, off_t offset,
+               struct fuse_file_info *fi) {
+  fatfuse_file *handle;
+  ssize_t result;
+
+  handle = (fatfuse_file*)(uintptr_t)fi->fh;
+  pthread_mutex_lock(&handle->lock);
+  result = fatedit_pread(handle->file, buf, size, offset);
+  pthread_mutex_unlock(&handle->lock);
+
+  return result < 0 ? fuseError(result) : (int)result;
+}
+
+/** fatfs_write - writes to an open file
+ **/
+int fatfs_write(const char *path, const char *buf, size_t size, off_t offset,
+                struct fuse_file_info *fi) {
+  fatfuse_file *handle;
+  ssize_t result;
+
+  handle = (fatfuse_file*)(uintptr_t)fi->fh;
+  pthread_mutex_lock(&handle->lock);
+  result = fatedit_pwrite(handle->file, buf, size, offset);
+  pthread_mutex_unlock(&handle->lock);
+
+  return result < 0 ? fuseError(result) : (int)result;
+}
+
+/** fatfs_truncate - cuts or extends a file, through its open handle when
+                     fuse passes one
+ **/
+int fatfs_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+  fatfuse_file *handle;
+  fatedit_file *file;
+  int error;
+
+  if (fi != NULL) {
+    handle = (fatfuse_file*)(uintptr_t)fi->fh;
+    pthread_mutex_lock(&handle->lock);
+    error = fatedit_ftruncate(handle->file, size);
+    pthread_mutex_unlock(&handle->lock);
+  }
+  else {
+    file = fatedit_file_open(mounted, path, O_WRONLY, &error);
+    if (file != NULL) {
+      error = fatedit_ftruncate(file, size);
+      fatedit_file_close(file);
+    }
+  }
+
+  return fuseError(error);
+}
+
+/** fatfs_fallocate - reserves space for a file, FAT can't keep clusters
+                      past the end of a file so the file grows to cover them
+ **/
+int fatfs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                    struct fuse_file_info *fi) {
+  fatfuse_file *handle;
+  int result;
+
+  if (mode != 0)
+    return -EOPNOTSUPP;
+
+  handle = (fatfuse_file*)(uintptr_t)fi->fh;
+  pthread_mutex_lock(&handle->lock);
+  result = fatedit_fallocate(handle->file, offset + length);
+  pthread_mutex_unlock(&handle->lock);
+
+  return fuseError(result);
+}
+
+/** fatfs_mkdir - creates a directory
+ **/
+int fatfs_mkdir(const char *path, mode_t mode) {
+  return fuseError(fatedit_mkdir(mounted, path));
+}
+
+/** fatfs_unlink - deletes a file
+ **/
+int fatfs_unlink(const char *path) {
+  return fuseError(fatedit_unlink(mounted, path, 0));
+}
+
+/** fatfs_rmdir - removes an empty directory
+ **/
+int fatfs_rmdir(const char *path) {
+  return fuseError(fatedit_rmdir(mounted, path));
+}
+
+/** fatfs_rename - moves an entry by rewriting directory entries only
+ **/
+int fatfs_rename(const char *from, const char *to, unsigned int flags) {
+  fatedit_info info;
+  int result;
+
+  // entries can't be swapped in one step
+  if (flags & RENAME_EXCHANGE)
+    return -EINVAL;
+
+  if ((flags & RENAME_NOREPLACE) && fatedit_stat(mounted, to, &info) == FATEDIT_OK)
+    result = FATEDIT_EEXIST;
+  else
+    result = fatedit_rename(mounted, from, to);
+
+  return fuseError(result);
+}
+
+/** fatfs_fsync - writes dirty sectors back and waits for them to reach
+                  the disk; closing a file doesn't write anything back, so
+                  a copy's sectors keep collecting in the cache and write
+                  errors show up here or at unmount rather than at close(2)
+ **/
+int fatfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  return fuseError(fatedit_fsync(mounted, datasync));
+}
+
+/** fatfs_statfs - reports free space from the allocator's counters, so df
+                   never scans the FAT
+ **/
+int fatfs_statfs(const char *path, struct statvfs *st) {
+  fatedit_volinfo info;
+  int result;
+
+  result = fatedit_statfs(mounted, &info);
+  if (result != FATEDIT_OK)
+    return fuseError(result);
+
+  memset(st, 0, sizeof(struct statvfs));
+  st->f_bsize = info.bytesPerCluster;
+  st->f_frsize = info.bytesPerCluster;
+  st->f_blocks = info.totalClusters;
+  st->f_bfree = info.freeClusters;
+  st->f_bavail = info.freeClusters;
+  st->f_namemax = 12;
+
+  return 0;
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+# fuse-smoke.sh - mounts a fresh image with fat-fuse, copies, moves and
+# truncates a file through the kernel, then checks the image with fat-edit
+# once it is unmounted; needs fuse3, run after make all fuse
+set -e
+
+dir=$(mktemp -d)
+img=$dir/smoke.img
+mnt=$dir/mnt
+trap 'fusermount3 -u "$mnt" 2>/dev/null || true; rm -rf "$dir"' EXIT
+
+./fat-edit -m -S 64 "$img" > /dev/null
+mkdir "$mnt"
+./fat-fuse -f -o image="$img" "$mnt" &
+pid=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+  mountpoint -q "$mnt" && break
+  sleep 0.5
+done
+mountpoint -q "$mnt"
+
+head -c 1000000 /dev/urandom > "$dir/data"
+mkdir "$mnt/sub"
+cp "$dir/data" "$mnt/sub/data.bin"
+cmp "$dir/data" "$mnt/sub/data.bin"
+mv "$mnt/sub/data.bin" "$mnt/moved.bin"
+truncate -s 5000 "$mnt/moved.bin"
+test "$(stat -c %s "$mnt/moved.bin")" = 5000
+rmdir "$mnt/sub"
+df "$mnt" > /dev/null
+
+# everything reaches the image by the time fat-fuse exits
+fusermount3 -u "$mnt"
+wait $pid
+printf 'size MOVED.BIN\n' | ./fat-edit "$img" | grep -q 5000
+
+echo "fuse-smoke: passed"
@@ -0,0 +1,141 @@
+/***
+ * File: libfatedit.h
+ * Handle-based interface to FAT32 images, the fat-edit REPL is built on it
+ ***/
+
+#ifndef LIBFATEDIT_H
+#define LIBFATEDIT_H
+
+#include <sys/types.h>
+#include <fcntl.h>
+
+#define FATEDIT_API __attribute__((visibility("default")))
+
+// error codes, calls return 0 or a byte/entry count on success
+#define FATEDIT_OK 0
+#define FATEDIT_ENOENT -1     // no such file or directory
+#define FATEDIT_EEXIST -2     // name already exists
+#define FATEDIT_ENOTDIR -3    // path component is not a directory
+#define FATEDIT_EISDIR -4     // entry is a directory
+#define FATEDIT_ENOTEMPTY -5  // directory is not empty
+#define FATEDIT_ENOSPC -6     // volume ran out of space
+#define FATEDIT_EACCES -7     // read-only file or handle opened without access
+#define FATEDIT_EINVAL -8     // invalid argument
+#define FATEDIT_EIO -9        // image could not be read or written
+#define FATEDIT_EBADIMG -10   // image is not a FAT32 volume
+#define FATEDIT_EOVERLAY -11  // overlay delta file can't be used
+#define FATEDIT_EBUSY -12     // files are still open
+
+// directory entry attributes
+#define FATEDIT_ATTR_READ_ONLY 0x01
+#define FATEDIT_ATTR_HIDDEN 0x02
+#define FATEDIT_ATTR_SYSTEM 0x04
+#define FATEDIT_ATTR_VOLUME_ID 0x08
+#define FATEDIT_ATTR_DIRECTORY 0x10
+#define FATEDIT_ATTR_ARCHIVE 0x20
+
+// fatedit_unlink flags
+#define FATEDIT_ERASE 0x01    // zero the file's clusters and entry
+
+// an open image with its own working directory and open files, a volume
+// handle may be called from many threads at once, reads of the image run
+// side by side and changes one at a time; a file handle is used by one
+// thread at a time
+typedef struct fatedit_volume fatedit_volume;
+typedef struct fatedit_file fatedit_file;
+
+// a directory entry
+typedef struct {
+  char name[13];               // "NAME.EXT"
+  char shortname[12];          // space padded 8.3 name as stored
+  unsigned char attr;
+  unsigned int firstCluster;
+  unsigned int size;
+  unsigned long long id;       // image offset of the entry, 0 for the root
+  long long created;           // seconds since the epoch, 0 when unset
+  long long modified;
+  long long accessed;          // FAT keeps the access date only
+} fatedit_info;
+
+// volume geometry and free space
+typedef struct {
+  unsigned int bytesPerCluster;
+  unsigned int totalClusters;
+  unsigned int freeClusters;
+  unsigned int nextFree;       // where the next allocation starts looking
+} fatedit_volinfo;
+
+// volumes, overlay is NULL to write to the image directly; partition N
+// opens the Nth MBR or GPT partition of a disk image in place, 0 the image
+// itself or else its first partition holding a FAT32 volume
+FATEDIT_API fatedit_volume *fatedit_open(const char *image, const char *overlay, int *error);
+FATEDIT_API fatedit_volume *fatedit_open_partition(const char *image, int partition,
+                                                   const char *overlay, int *error);
+FATEDIT_API int fatedit_close(fatedit_volume *v);
+FATEDIT_API int fatedit_sync(fatedit_volume *v);
+
+// fsync also waits for the writes to reach the disk, only the file data
+// and not its metadata when datasync is set
+FATEDIT_API int fatedit_fsync(fatedit_volume *v, int datasync);
+
+// overlay_commit writes the changes held in the overlay into the image and
+// overlay_discard throws them away, needing every file closed first; both
+// leave the overlay empty and still in use, FATEDIT_EINVAL without one
+FATEDIT_API int fatedit_overlay_commit(fatedit_volume *v);
+FATEDIT_API int fatedit_overlay_discard(fatedit_volume *v);
+
+// statfs answers from counters kept as clusters are allocated and freed,
+// recount rebuilds them from the FAT and returns the free cluster count
+FATEDIT_API int fatedit_statfs(fatedit_volume *v, fatedit_volinfo *info);
+FATEDIT_API int fatedit_recount(fatedit_volume *v);
+
+// paths are relative to the working directory unless they start with '/',
+// readdir fills up to max entries from *cookie (0 to start) and advances
+// it, returning 0 once the directory is exhausted
+FATEDIT_API int fatedit_chdir(fatedit_volume *v, const char *path);
+FATEDIT_API int fatedit_stat(fatedit_volume *v, const char *path, fatedit_info *st);
+FATEDIT_API int fatedit_readdir(fatedit_volume *v, const char *path,
+                                fatedit_info *entries, int max, long long *cookie);
+
+// walk calls visit for every entry below path, on up to threads threads
+// at once and in no particular order; a nonzero return from visit stops
+// the walk and is returned
+typedef int (*fatedit_visit)(const char *path, const fatedit_info *info, void *arg);
+FATEDIT_API int fatedit_walk(fatedit_volume *v, const char *path, int threads,
+                             fatedit_visit visit, void *arg);
+
+FATEDIT_API int fatedit_mkdir(fatedit_volume *v, const char *path);
+FATEDIT_API int fatedit_rmdir(fatedit_volume *v, const char *path);
+FATEDIT_API int fatedit_unlink(fatedit_volume *v, const char *path, int flags);
+
+// rename moves an entry within or across directories without touching
+// its data, a file moved onto another file replaces it
+FATEDIT_API int fatedit_rename(fatedit_volume *v, const char *from, const char *to);
+
+// copy duplicates a file into a new one inside the image
+FATEDIT_API int fatedit_copy(fatedit_volume *v, const char *from, const char *to);
+
+// compact moves a directory's entries over the slots deleted entries left
+// and releases the clusters emptied at its end, returning the slots
+// reclaimed; a readdir cookie taken before it no longer applies
+FATEDIT_API int fatedit_compact(fatedit_volume *v, const char *path, unsigned int *released);
+
+// files, flags are O_RDONLY, O_WRONLY or O_RDWR with O_CREAT, O_EXCL, O_TRUNC,
+// O_APPEND; offsets are 64-bit whatever off_t is in the caller's build, and
+// writes through an O_APPEND handle go to the end of the file whatever the
+// offset given
+FATEDIT_API fatedit_file *fatedit_file_open(fatedit_volume *v, const char *path,
+                                            int flags, int *error);
+FATEDIT_API int fatedit_file_close(fatedit_file *f);
+FATEDIT_API int fatedit_fstat(fatedit_file *f, fatedit_info *st);
+FATEDIT_API ssize_t fatedit_pread(fatedit_file *f, void *buf, size_t len, long long offset);
+FATEDIT_API ssize_t fatedit_pwrite(fatedit_file *f, const void *buf, size_t len, long long offset);
+
+// ftruncate sets a file's size, fallocate only ever grows it; new space
+// reads back as zeros and is taken as one contiguous extent when possible
+FATEDIT_API int fatedit_ftruncate(fatedit_file *f, long long size);
+FATEDIT_API int fatedit_fallocate(fatedit_file *f, long long size);
+
+FATEDIT_API const char *fatedit_strerror(int error);
+
+#endif